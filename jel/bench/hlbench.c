@@ -0,0 +1,81 @@
+// Highlighting benchmark: runs the C highlighter over source files and reports MB/s
+
+// jel is one translation unit: take all of it but its main (and its includes)
+#define main jel_main
+#include "../jel.c"
+#undef main
+
+#define MIN_MS 500
+
+static double now_ms(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// highlight every row of the file again and again for at least MIN_MS
+static double bench(const char *filename){
+  editorOpen((char *)filename);
+  tbFinishIndex(E.buf);
+  editorCountRows();
+  if (E.syntax == NULL){
+    fprintf(stderr, "%s: no syntax for this file\n", filename);
+    return -1;
+  }
+
+  // rendered (and highlighted once) up front: only highlighting is timed
+  int n = E.numrows;
+  erow *rows = calloc(n ? n : 1, sizeof(erow));
+  size_t bytes = 0;
+  for (int i = 0; i < n; i++){
+    size_t start;
+    rows[i].size = editorRowSpan(i, &start);
+    rows[i].chars = malloc(rows[i].size + 1);
+    tbRead(E.buf, start, rows[i].size, rows[i].chars);
+    rows[i].chars[rows[i].size] = '\0';
+    rows[i].idx = i;
+    editorUpdateRow(&rows[i]);
+    bytes += rows[i].rsize + 1;
+  }
+
+  double start = now_ms(), ms;
+  size_t total = 0;
+  do{
+    int state = LEX_NORMAL;
+    for (int i = 0; i < n; i++)
+      state = editorHighlight(&rows[i], state);
+    total += bytes;
+  } while ((ms = now_ms() - start) < MIN_MS);
+
+  for (int i = 0; i < n; i++){
+    free(rows[i].chars);
+    free(rows[i].render);
+    free(rows[i].hl);
+  }
+  free(rows);
+  return total / 1e6 / (ms / 1e3);
+}
+
+int main(int argc, char *argv[]){
+  if (argc < 2){
+    fprintf(stderr, "usage: %s file.c...\n", argv[0]);
+    return 1;
+  }
+
+  // what initEditor sets up, without a terminal
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.rcache = calloc(64, sizeof(erow));
+  E.rcachemask = 63;
+  for (int j = 0; j < 64; j++)
+    E.rcache[j].idx = -1;
+  E.buf = tbCreate(NULL, 0);
+
+  printf("%-24s %10s\n", "file", "MB/s");
+  for (int i = 1; i < argc; i++){
+    double mbs = bench(argv[i]);
+    if (mbs >= 0)
+      printf("%-24s %10.1f\n", argv[i], mbs);
+  }
+  return 0;
+}
@@ -1,4 +1,7 @@
 /*** includes ***/
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -11,6 +14,9 @@
 #include <time.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+
+#include "jel_buf.h"
 
 
 
@@ -20,9 +26,6 @@
 
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
 #define ABUF_INIT {NULL,0} // acts as constructor for abuf type
 #define JEL_TAB_STOP 8 
 #define JEL_QUIT_TIMES 1
@@ -58,13 +61,35 @@ enum editorHighlight{
 
 struct editorSyntax{
   char *filetype;
-  char **keywords;
   char **filematch;
+  char **keywords;
   char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
   int flags;
+  struct editorKeywords *kw; // keywords as a trie, built when the syntax is first selected
+};
+
+// trie of a syntax's keywords. bytes that occur in no keyword are class 0,
+// the others numbered from 1; each node has a row of next nodes by class
+struct editorKeywords{
+  unsigned char cls[256];
+  int nclasses;
+  int *next;            // next[node * nclasses + class], 0 for none
+  unsigned char *match; // HL_KEYWORD1/2 if a keyword ends at the node, else 0
+};
+
+// lexer state where a row ends (and the next one starts): LEX_NORMAL,
+// LEX_COMMENT inside a block comment, or the quote character of a string
+// that a backslash carries on to the next row
+enum editorLexState{
+  LEX_NORMAL = 0,
+  LEX_COMMENT
 };
 
+// rendered copy of one row of E.buf; only rows on screen (and the cursor's) are kept
 typedef struct erow{
+  int idx; // row number, -1 for an empty cache slot
   int size;
   int rsize;
   char *render;
@@ -83,7 +108,12 @@ struct editorConfig{
   int dirty;
   char *filename;
   char statusmsg[80];
-  erow *row;
+  textbuf *buf;
+  erow *rcache; // slot is row number & rcachemask
+  int rcachemask;
+  unsigned char *hlstate; // lexer state at the end of each of the first hlrows rows
+  int hlrows;
+  int hlcap;
   time_t statusmsg_time;
   struct editorSyntax *syntax;
   struct termios orig_termios; //acts as the template struct to use (global variable)
@@ -105,8 +135,9 @@ struct editorSyntax HLDB[] = {
     "c",
     C_HL_extensions,
     C_HL_keywords,
-    "//",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
 };
 
@@ -149,8 +180,13 @@ void enableRawMode(){
 int editorReadKey() {
   int nread;
   char c;
+  int indexing = tbIndexing(E.buf);
   while ((nread = read(STDIN_FILENO,&c,1)) != 1){
     if (nread == -1 && errno != EAGAIN) die("read");
+    if (indexing){ // keep the line count moving while the file is indexed
+      indexing = tbIndexing(E.buf);
+      editorRefreshScreen();
+    }
   }
 
   if(c == '\x1b'){
@@ -258,39 +294,125 @@ int getWindowSize(int *rows, int *cols){
 /*** syntax highlighting ***/
 
 int is_separator(int c){
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];\"",c) != NULL;
+  static const char sep[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+    [','] = 1, ['.'] = 1, ['('] = 1, [')'] = 1, ['+'] = 1, ['-'] = 1, ['/'] = 1, ['*'] = 1,
+    ['='] = 1, ['~'] = 1, ['%'] = 1, ['<'] = 1, ['>'] = 1, ['['] = 1, [']'] = 1, [';'] = 1,
+    ['"'] = 1
+  };
+  return sep[(unsigned char)c];
 }
 
-void editorUpdateSyntax(erow *row){
+// keywords ending in '|' are HL_KEYWORD2, the rest HL_KEYWORD1
+struct editorKeywords *editorBuildKeywords(char **keywords){
+  struct editorKeywords *kw = calloc(1, sizeof(struct editorKeywords));
+  int j, k, nodes = 1;
+  size_t bytes = 0;
+
+  for (j = 0; keywords[j]; j++)
+    for (k = 0; keywords[j][k]; k++){
+      unsigned char c = keywords[j][k];
+      bytes++;
+      if (!kw->cls[c])
+        kw->cls[c] = ++kw->nclasses;
+    }
+  kw->cls['|'] = 0; // marks KEYWORD2, not part of the keyword
+  kw->nclasses++;
+
+  // at most a node per byte, plus the root
+  kw->next = calloc((bytes + 1) * kw->nclasses, sizeof(int));
+  kw->match = calloc(bytes + 1, 1);
+  for (j = 0; keywords[j]; j++){
+    int klen = strlen(keywords[j]);
+    int kw2 = keywords[j][klen-1] == '|';
+    int node = 0;
+    if (kw2) klen--;
+    for (k = 0; k < klen; k++){
+      int *next = &kw->next[node * kw->nclasses + kw->cls[(unsigned char)keywords[j][k]]];
+      if (!*next)
+        *next = nodes++;
+      node = *next;
+    }
+    if (!kw->match[node])
+      kw->match[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  return kw;
+}
+
+// longest keyword s starts with that a separator follows: its highlight and length
+int editorMatchKeyword(struct editorKeywords *kw, const char *s, int *len){
+  int node = 0, hl = 0;
+  unsigned char c;
+  for (int j = 0; (c = kw->cls[(unsigned char)s[j]]) != 0; j++){
+    node = kw->next[node * kw->nclasses + c];
+    if (node == 0)
+      break;
+    if (kw->match[node] && is_separator(s[j + 1])){
+      hl = kw->match[node];
+      *len = j + 1;
+    }
+  }
+  return hl;
+}
+
+// highlight row as if it starts in lexer state state; returns the state it ends in
+int editorHighlight(erow *row, int state){
   row->hl = realloc(row->hl, row->rsize);
   memset(row->hl, HL_NORMAL, row->rsize);
 
   if(E.syntax == NULL)
-    return;
+    return LEX_NORMAL;
 
-  char **keywords = E.syntax->keywords;
+  struct editorKeywords *kw = E.syntax->kw;
 
   char *scs = E.syntax -> singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
   int scs_len = scs ? strlen(scs) :0;   
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
 
   int prev_sep = 1;
-  int in_string = 0;
+  int in_string = state == LEX_COMMENT ? 0 : state;
+  int in_comment = state == LEX_COMMENT;
 
   int i = 0;
   while (i < row->rsize){
     char c = row->render[i];
     unsigned char prev_hl = (i>0) ? row->hl[i-1]:HL_NORMAL;
 
-    if (scs_len && !in_string){
-      if(!strncmp(&row->render[i], scs, scs_len)){
+    if (scs_len && !in_string && !in_comment){
+      if(c == scs[0] && !strncmp(&row->render[i], scs, scs_len)){
         memset(&row->hl[i], HL_COMMENT, row->rsize - i);
         break;
       }
     }
 
+    if (mcs_len && mce_len && !in_string){
+      if (in_comment){
+        row->hl[i] = HL_COMMENT;
+        if (c == mce[0] && !strncmp(&row->render[i], mce, mce_len)){
+          memset(&row->hl[i], HL_COMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else{
+          i++;
+        }
+        continue;
+      } else if (c == mcs[0] && !strncmp(&row->render[i], mcs, mcs_len)){
+        memset(&row->hl[i], HL_COMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS){
       if (in_string){
         row->hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 == row->rsize) // string goes on in the next row
+          return in_string;
         if(c=='\\' && i+1<row->rsize){
           row->hl[i+1] = HL_STRING;
           i+=2;
@@ -322,20 +444,11 @@ void editorUpdateSyntax(erow *row){
   }
 
   if (prev_sep) {
-    int j;
-    for(j=0; keywords[j];j++){
-      int klen = strlen(keywords[j]);
-      int kw2 = keywords[j][klen-1] == '|';
-      if(kw2) klen--;
-
-      if(!strncmp(&row->render[i], keywords[j], klen) && 
-        is_separator(row->render[i + klen])){
-          memset(&row->hl[i],kw2 ? HL_KEYWORD2: HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-    }
-    if (keywords[j] != NULL){
+    int klen;
+    int hl = editorMatchKeyword(kw, &row->render[i], &klen);
+    if (hl){
+      memset(&row->hl[i], hl, klen);
+      i += klen;
       prev_sep = 0;
       continue;
     }
@@ -343,6 +456,102 @@ void editorUpdateSyntax(erow *row){
     prev_sep = is_separator(c);
     i++;
   }
+  return in_comment ? LEX_COMMENT : LEX_NORMAL;
+}
+
+void editorRowsShifted(int at, int by);
+int editorRowSpan(int at, size_t *start);
+
+// the state row at ends in, without keeping its highlighting
+int editorLexRow(int at, int state){
+  static erow scratch; // tabs lex like the spaces they render as: no need to expand them
+  size_t start;
+  int len = editorRowSpan(at, &start);
+  scratch.render = realloc(scratch.render, len + 1);
+  tbRead(E.buf, start, len, scratch.render);
+  scratch.render[len] = '\0';
+  scratch.rsize = len;
+  return editorHighlight(&scratch, state);
+}
+
+void editorSetRowState(int at, int state){
+  if (at == E.hlcap){
+    E.hlcap = E.hlcap ? E.hlcap * 2 : 1024;
+    E.hlstate = realloc(E.hlstate, E.hlcap);
+  }
+  E.hlstate[at] = state;
+  if (at == E.hlrows)
+    E.hlrows++;
+}
+
+// states are known for rows before at only
+void editorDropStates(int at){
+  E.hlrows = at;
+  for (int j = 0; j <= E.rcachemask; j++)
+    if (E.rcache[j].idx >= at)
+      E.rcache[j].idx = -1;
+}
+
+// state row at starts in: the rows above it never lexed are lexed now
+int editorEntryState(int at){
+  while (E.hlrows < at)
+    editorSetRowState(E.hlrows, editorLexRow(E.hlrows, E.hlrows ? E.hlstate[E.hlrows - 1] : LEX_NORMAL));
+  return at ? E.hlstate[at - 1] : LEX_NORMAL;
+}
+
+// rows [at, at+n) changed: lex them again, and the rows after them until one
+// ends as it did before. past the bottom of the screen the states are dropped
+// instead and lexed again once those rows are needed
+void editorSyntaxChanged(int at, int n){
+  int bottom = E.rowoff + E.screenrows;
+  for (int r = at; r < E.hlrows; r++){
+    if (r >= at + n && r > bottom){
+      editorDropStates(r);
+      return;
+    }
+    erow *cached = &E.rcache[r & E.rcachemask];
+    if (cached->idx == r) // starts in a different state (or reads differently)
+      cached->idx = -1;
+    int state = editorLexRow(r, r ? E.hlstate[r - 1] : LEX_NORMAL);
+    if (r >= at + n && state == E.hlstate[r])
+      return;
+    E.hlstate[r] = state;
+  }
+}
+
+// rows from at on moved down by `by` rows (up if negative): move their states along
+void editorSyntaxShifted(int at, int by){
+  if (E.syntax == NULL || at >= E.hlrows)
+    return;
+  if (by < 0){
+    int n = at - by > E.hlrows ? E.hlrows - at : -by;
+    memmove(&E.hlstate[at], &E.hlstate[at + n], E.hlrows - at - n);
+    E.hlrows -= n;
+  } else if (by > 0){
+    while (E.hlrows + by > E.hlcap){
+      E.hlcap *= 2;
+      E.hlstate = realloc(E.hlstate, E.hlcap);
+    }
+    memmove(&E.hlstate[at + by], &E.hlstate[at], E.hlrows - at);
+    E.hlrows += by;
+  }
+  // the row at and the rows inserted after it are new text
+  editorSyntaxChanged(at, by > 0 ? by + 1 : 0);
+}
+
+void editorUpdateSyntax(erow *row){
+  if (E.syntax == NULL){
+    editorHighlight(row, LEX_NORMAL);
+    return;
+  }
+  int at = row->idx;
+  int state = editorHighlight(row, editorEntryState(at));
+  if (at == E.hlrows){
+    editorSetRowState(at, state);
+  } else if (state != E.hlstate[at]){
+    E.hlstate[at] = state;
+    editorSyntaxChanged(at + 1, 0);
+  }
 }
 
 int editorSyntaxToColor(int hl){
@@ -359,24 +568,23 @@ int editorSyntaxToColor(int hl){
 
 void editorSelectSyntaxHighlight(){
   E.syntax = NULL;
+  E.hlrows = 0;
   if (E.filename == NULL)
     return;
   
   char *ext = strrchr(E.filename,'.');
 
-  for (unsigned int j = 0; j< HLDB; j++){
+  for (unsigned int j = 0; j< HLDB_ENTRIES; j++){
     struct editorSyntax *s = &HLDB[j];
     unsigned int i = 0;
     while (s->filematch[i]){
       int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && !strcmp(ext,s->filematch[i])) ||
+      if ((is_ext && ext && !strcmp(ext,s->filematch[i])) ||
           (!is_ext && strstr(E.filename,s->filematch[i]))){
         E.syntax = s;
-
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++){
-          editorUpdateSyntax(&E.row[filerow]);
-        }
+        if (s->kw == NULL)
+          s->kw = editorBuildKeywords(s->keywords);
+        editorRowsShifted(0, 0); // only rows drawn get highlighted, and the rows above them lexed
         return;
         }
       i++;
@@ -411,23 +619,66 @@ void editorUpdateRow(erow *row){
   
 }
 
+// offset of row at in E.buf and its length without the line break (and any '\r' before it)
+int editorRowSpan(int at, size_t *start){
+  size_t end = (size_t)at < tbNewlines(E.buf) ? tbLineStart(E.buf, at + 1) - 1 : tbLength(E.buf);
+  char c;
+  *start = tbLineStart(E.buf, at);
+  while (end > *start && tbRead(E.buf, end - 1, 1, &c) && c == '\r')
+    end--;
+  return end - *start;
+}
+
+// rows: one per line break, plus a last line without one (known once the file is indexed)
+void editorCountRows(){
+  char c = '\n';
+  size_t len = tbLength(E.buf);
+  if (len && !tbIndexing(E.buf))
+    tbRead(E.buf, len - 1, 1, &c);
+  E.numrows = tbNewlines(E.buf) + (c != '\n');
+}
+
+erow *editorRow(int at){
+  erow *row = &E.rcache[at & E.rcachemask];
+  if (row->idx == at)
+    return row;
+
+  size_t start;
+  int len = editorRowSpan(at, &start);
+  row->chars = realloc(row->chars, len + 1);
+  tbRead(E.buf, start, len, row->chars);
+  row->chars[len] = '\0';
+  row->size = len;
+  row->idx = at;
+  editorUpdateRow(row);
+  return row;
+}
+
+// rows from at on moved down by `by` rows (up if negative) or changed: drop them from the cache
+void editorRowsShifted(int at, int by){
+  for (int j = 0; j <= E.rcachemask; j++)
+    if (E.rcache[j].idx >= at)
+      E.rcache[j].idx = -1;
+  editorCountRows();
+  editorSyntaxShifted(at, by);
+}
+
+// give a last row without a line break one, before rows are added after it
+void editorTerminateRows(){
+  if ((size_t)E.numrows > tbNewlines(E.buf))
+    tbInsert(E.buf, tbLength(E.buf), "\n", 1);
+}
+
 void editorInsertRow(int at,char *s, size_t len){
   if (at <0 || at > E.numrows)
     return;
-  E.row =  realloc(E.row,sizeof(erow)*(E.numrows +1));
-  memmove(&E.row[at+1],&E.row[at],sizeof(erow)*(E.numrows-at));
-
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  if (at == E.numrows)
+    editorTerminateRows();
+  size_t off = tbLineStart(E.buf, at);
+  tbInsert(E.buf, off, s, len);
+  tbInsert(E.buf, off + len, "\n", 1);
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  editorUpdateRow(&E.row[at]);
-
-  E.numrows++;
+  editorRowsShifted(at, 1);
   E.dirty++; // instead of treating dirty as a bool, maybe we can use this value to see how dirty the file is ?
 }
 
@@ -459,6 +710,8 @@ int editorRowRxToCx(erow *row, int rx){
 void editorRowInsertChar(erow *row, int at, int c){
   if (at < 0 || at > row->size) 
     at = row->size;
+  char ch = c;
+  tbInsert(E.buf, tbLineStart(E.buf, row->idx) + at, &ch, 1);
   row->chars = realloc(row->chars, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
@@ -471,28 +724,24 @@ void editorRowInsertChar(erow *row, int at, int c){
 void editorRowDelChar(erow *row, int at){
   if (at <0 || at>= row->size)
     return;
+  tbDelete(E.buf, tbLineStart(E.buf, row->idx) + at, 1);
   memmove(&row->chars[at], &row->chars[at+1],row->size - at);
   row->size--;
   editorUpdateRow(row);
   E.dirty++;
 }
 
-void editorFreeRow(erow *row){
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
-}
-
 void editorDelRow(int at){
   if (at<0 || at >= E.numrows)
     return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at],&E.row[at+1],sizeof(erow) * (E.numrows-at-1));
-  E.numrows--;
+  size_t start = tbLineStart(E.buf, at);
+  tbDelete(E.buf, start, tbLineStart(E.buf, at + 1) - start);
+  editorRowsShifted(at, -1);
   E.dirty++;
 }
 
 void editorRowAppendString(erow *row,char*s,size_t len){
+  tbInsert(E.buf, tbLineStart(E.buf, row->idx) + row->size, s, len);
   row->chars = realloc(row->chars,row->size+len+1);
   memcpy(&row->chars[row->size],s,len);
   row->size+=len;
@@ -507,7 +756,7 @@ void editorInsertChar(int c){
   if (E.cy == E.numrows){
     editorInsertRow(E.numrows,"",0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(editorRow(E.cy), E.cx, c);
   E.cx++;
 } 
 
@@ -515,12 +764,11 @@ void editorInsertNewLine(){
   if (E.cx == 0){
     editorInsertRow(E.cy,"",0);
   } else{
-    erow*row = &E.row[E.cy];
-    editorInsertRow(E.cy+1,&row->chars[E.cx],row->size-E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    if (E.cy == E.numrows - 1)
+      editorTerminateRows();
+    tbInsert(E.buf, tbLineStart(E.buf, E.cy) + E.cx, "\n", 1);
+    editorRowsShifted(E.cy, 1);
+    E.dirty++;
   }
   E.cy++;
   E.cx = 0;
@@ -532,57 +780,31 @@ void editorDelChar(){
   if (E.cx==0 && E.cy==0)
     return;
 
-  erow *row = &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   if(E.cx >0){
     editorRowDelChar(row, E.cx -1 );
     E.cx--;
   } else{
-    E.cx = E.row[E.cy -1].size;
-    editorRowAppendString(&E.row[E.cy -1], row->chars, row->size);
+    erow *prev = editorRow(E.cy - 1); // a different cache slot than row
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
     editorDelRow(E.cy);
     E.cy--;
   }
 }
 
 /*** file i/o ***/
-char *editorRowsToString(int *buflen){
-  int totlen = 0;
-  int j;
-  for (j = 0;j < E.numrows;j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for ( j = 0;j< E.numrows;j++){
-    memcpy(p,E.row[j].chars,E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
-  }
-  return buf; 
-}
-
 void editorOpen(char *filename){
   free(E.filename);
   E.filename = strdup(filename);
 
+  // mapped, not read: the first screen only waits for its own lines to be indexed
+  tbFree(E.buf);
+  E.buf = tbOpen(filename);
+  if (E.buf == NULL)
+    die("open");
+  editorCountRows();
   editorSelectSyntaxHighlight();
-  FILE *fp = fopen(filename,"r");
-  if (!fp) 
-    die("fopen");
-  
-  char *line = NULL;
-  size_t linecap = 0;  
-  ssize_t linelen;
-  while ((linelen = getline(&line,&linecap,fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || 
-                            line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows,line,linelen);
-}
-  free(line);
-  fclose(fp);
   E.dirty = 0;
 }
 
@@ -597,30 +819,36 @@ void editorSave(){
     editorSelectSyntaxHighlight();
   }
 
-    return;
-
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  // write a new file and rename it over the old one: the buffer may still be
+  // reading the old one through its mapping, which must not change under it.
+  // A symlink is followed so the file it points to is replaced, not the link
+  char tmp[4096];
+  struct stat st;
+  char *real = realpath(E.filename, NULL);
+  const char *target = real ? real : E.filename;
+  int exists = stat(target, &st) == 0;
+  snprintf(tmp, sizeof(tmp), "%s.jel-save", target);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, exists ? st.st_mode & 07777 : 0644);
   if (fd != -1){
-    if(ftruncate(fd,len) != -1){
-      if(write(fd,buf,len) == len){
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+    // keep the owner and group; only root may give a file away, so EPERM is fine
+    ssize_t len = -1;
+    if (!exists || fchown(fd, st.st_uid, st.st_gid) == 0 || errno == EPERM)
+      // every row followed by '\n': line breaks as in E.buf minus the '\r' of CRLF
+      len = tbWrite(E.buf, fd, TB_LF);
+    if (close(fd) == 0 && len != -1 && rename(tmp, target) == 0){
+      free(real);
+      E.dirty = 0;
+      editorSetStatusMessage("%zd bytes written to disk", len);
+      return;
     }
-    close(fd);
+    int err = errno;
+    unlink(tmp);
+    errno = err;
   }
-  free(buf);
+  free(real);
   editorSetStatusMessage("Cant't save! I/O error: %s", strerror(errno));
 }
 
-// idea for later: write to a new, temporary file, and then rename that file to the actual file the user wants to overwrite, and they’ll carefully check for errors through the whole process.
-
 /*** find ***/
 
 void editorFindCallback(char *query, int key){
@@ -631,7 +859,8 @@ void editorFindCallback(char *query, int key){
   static char *saved_hl = NULL;
 
   if (saved_hl){
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    erow *row = editorRow(saved_hl_line);
+    memcpy(row->hl, saved_hl, row->rsize);
     free(saved_hl);
     saved_hl = NULL;
   }
@@ -663,7 +892,7 @@ void editorFindCallback(char *query, int key){
     else if (current == E.numrows) 
       current = 0;
     
-    erow *row = &E.row[current];
+    erow *row = editorRow(current);
     char *match = strstr(row->render,query);
     if (match){
       last_match = current;
@@ -682,6 +911,9 @@ void editorFindCallback(char *query, int key){
 
 }
 void editorFind(){
+  tbFinishIndex(E.buf); // search sees every row
+  editorCountRows();
+
   int saved_cx = E.cx;
   int saved_cy = E.cy;
   int saved_coloff = E.coloff;
@@ -726,7 +958,7 @@ void abFree(struct abuf *ab){
 void editorScroll(){
   E.rx = 0;
   if (E.cy < E.numrows){
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff){
@@ -763,13 +995,14 @@ void editorDrawRows(struct abuf *ab){
     }
   }
      else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = editorRow(filerow);
+      int len = row->rsize - E.coloff;
       if (len < 0) 
         len = 0;
      if (len > E.screencols)
         len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      char *c = &row->render[E.coloff];
+      unsigned char *hl = &row->hl[E.coloff];
       int current_color = -1;
       int j;
       for (j=0;j<len;j++){
@@ -803,10 +1036,10 @@ void editorDrawRows(struct abuf *ab){
 void editorDrawStatusBar(struct abuf *ab){
   abAppend(ab, "\x1b[7m",4); 
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-    E.filename ? E.filename : "[No Name]", E.numrows,
+  int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s", 
+    E.filename ? E.filename : "[No Name]", E.numrows, tbIndexing(E.buf) ? "+" : "",
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", 
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
   if (len > E.screencols) 
     len = E.screencols;
@@ -835,6 +1068,11 @@ void editorDrawMessageBar(struct abuf *ab){
 }
 
 void editorRefreshScreen(){
+  if (tbIndexing(E.buf)){
+    // wait for the rows about to be drawn, count the ones found so far
+    tbLineStart(E.buf, (E.cy > E.rowoff ? E.cy : E.rowoff) + E.screenrows + 1);
+    editorCountRows();
+  }
   editorScroll();
 
   struct abuf ab = ABUF_INIT;
@@ -867,7 +1105,7 @@ void editorSetStatusMessage(const char *fmt, ...){
 /*** input ***/
 
 void editorMoveCursor(int key){
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
 
   switch(key){
     case ARROW_UP:
@@ -882,12 +1120,12 @@ void editorMoveCursor(int key){
       }
       else if (E.cy > 0){
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRow(E.cy)->size;
       }
       break;
 
     case ARROW_DOWN:
-      if(E.cy != E.screenrows - 1){
+      if(E.cy < E.numrows){
         E.cy++;
       }     
       break;
@@ -903,7 +1141,7 @@ void editorMoveCursor(int key){
       break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen){
       E.cx = rowlen;}
@@ -940,7 +1178,7 @@ void editorProcessKeypress(){
 
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRow(E.cy)->size;
       break;
     
     case CTRL_KEY('f'):
@@ -1045,12 +1283,21 @@ void initEditor(){
   E.coloff = 0;
   E.dirty = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.buf = tbCreate(NULL, 0);
   E.syntax = 0;
   E.filename = NULL;
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
   E.screenrows -= 2; 
+
+  // visible rows never share a slot
+  int slots = 64;
+  while (slots < 2 * E.screenrows)
+    slots *= 2;
+  E.rcache = calloc(slots, sizeof(erow));
+  E.rcachemask = slots - 1;
+  for (int j = 0; j < slots; j++)
+    E.rcache[j].idx = -1;
 }
 
 int main(int argc, char *argv[]){
@@ -0,0 +1,671 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "jel_buf.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define JEL_SIMD
+#include <immintrin.h>
+#endif
+
+#define NL_BLOCK 65536          // newline offsets per index block
+#define INDEX_STEP (1 << 20)    // bytes the indexer scans between updates
+#define WRITE_IOVS 1024         // iovecs per writev, the usual IOV_MAX
+#define WRITE_COPY 256          // spans shorter than this are copied together
+
+enum { ORIG, ADD };
+
+typedef struct piece{
+  struct piece *l, *r;
+  unsigned int pri;   // treap heap key, random
+  int buf;            // ORIG or ADD
+  size_t start, len;  // bytes of that buffer
+  size_t nl;          // newlines among them
+  size_t sumlen;      // bytes and newlines of the whole subtree
+  size_t sumnl;
+} piece;
+
+// sorted offsets of every '\n' in a buffer, in fixed blocks so the indexer
+// thread can add blocks while the editor reads the ones before them. the
+// offsets are uint32_t until the buffer outgrows that, then uint64_t
+struct nlindex{
+  void **blk;
+  size_t nblk;
+  size_t n;           // entries the editor thread may use
+  int wide;
+};
+
+struct textbuf{
+  char *data[2];
+  size_t origlen;
+  int mapped;         // data[ORIG] is an mmap of the file
+  size_t addlen, addcap;
+  struct nlindex nl[2];
+  piece *root;        // the text is the tree followed by data[ORIG] from tail on
+  size_t tail;
+  piece *last;        // piece the previous insert made, grown in place by the next one
+  size_t lastend;     // text offset just past it
+  unsigned int seed;
+
+  // background indexing of data[ORIG]
+  int threaded;
+  pthread_t indexer;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+  size_t scanned;     // under lock: bytes indexed so far,
+  size_t found;       // newlines among them
+  int stop;           // and a request to give up
+};
+
+static void *xrealloc(void *p, size_t n){
+  p = realloc(p, n);
+  if (p == NULL && n)
+    abort();
+  return p;
+}
+
+static unsigned int rnd(textbuf *tb){
+  unsigned int x = tb->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return tb->seed = x;
+}
+
+static size_t nlAt(struct nlindex *ix, size_t i){
+  void *b = ix->blk[i / NL_BLOCK];
+  return ix->wide ? ((uint64_t *)b)[i % NL_BLOCK] : ((uint32_t *)b)[i % NL_BLOCK];
+}
+
+// switch the offsets to 64 bits; only for the add buffer, which no other
+// thread reads
+static void nlWiden(struct nlindex *ix, size_t n){
+  for (size_t k = 0; k * NL_BLOCK < n; k++){
+    uint32_t *old = ix->blk[k];
+    uint64_t *b = xrealloc(NULL, NL_BLOCK * sizeof(uint64_t));
+    for (size_t i = 0; i < NL_BLOCK && k * NL_BLOCK + i < n; i++)
+      b[i] = old[i];
+    free(old);
+    ix->blk[k] = b;
+  }
+  ix->wide = 1;
+}
+
+// a new block for entry n, or 64-bit entries for offset off
+static void nlGrow(struct nlindex *ix, size_t n, size_t off){
+  if (!ix->wide && off > UINT32_MAX)
+    nlWiden(ix, n);
+  if (n % NL_BLOCK == 0){
+    if (n / NL_BLOCK == ix->nblk){
+      size_t old = ix->nblk;
+      ix->nblk = old ? old * 2 : 16;
+      ix->blk = xrealloc(ix->blk, ix->nblk * sizeof(void *));
+      memset(ix->blk + old, 0, (ix->nblk - old) * sizeof(void *));
+    }
+    ix->blk[n / NL_BLOCK] = xrealloc(NULL, NL_BLOCK * (ix->wide ? sizeof(uint64_t) : sizeof(uint32_t)));
+  }
+}
+
+static inline void nlPut(struct nlindex *ix, size_t n, size_t off){
+  if (n % NL_BLOCK == 0 || (!ix->wide && off > UINT32_MAX))
+    nlGrow(ix, n, off);
+  if (ix->wide)
+    ((uint64_t *)ix->blk[n / NL_BLOCK])[n % NL_BLOCK] = off;
+  else
+    ((uint32_t *)ix->blk[n / NL_BLOCK])[n % NL_BLOCK] = off;
+}
+
+// newlines of 64 bytes as a bit mask, 16 or 32 bytes per compare
+#ifdef JEL_SIMD
+static uint64_t newlineMask16(const char *p){
+  const __m128i nl = _mm_set1_epi8('\n');
+  uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+  uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+  uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+  uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+  return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+
+__attribute__((target("avx2")))
+static uint64_t newlineMask32(const char *p){
+  const __m256i nl = _mm256_set1_epi8('\n');
+  uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl));
+  uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), nl));
+  return lo | hi << 32;
+}
+#endif
+
+// record the newlines of base[start, start+len) from entry n on; returns the new count
+static size_t indexNewlines(struct nlindex *ix, const char *base, size_t start, size_t len, size_t n){
+  size_t off = start, end = start + len;
+#ifdef JEL_SIMD
+  int avx2 = __builtin_cpu_supports("avx2");
+  for (; end - off >= 64; off += 64){
+    uint64_t m = avx2 ? newlineMask32(base + off) : newlineMask16(base + off);
+    for (; m; m &= m - 1)
+      nlPut(ix, n++, off + __builtin_ctzll(m));
+  }
+#endif
+  const char *p = base + off, *e = base + end;
+  while ((p = memchr(p, '\n', e - p)) != NULL){
+    nlPut(ix, n++, p - base);
+    p++;
+  }
+  return n;
+}
+
+// first index whose newline is at or after off
+static size_t lowerBound(struct nlindex *ix, size_t off){
+  size_t lo = 0, hi = ix->n;
+  while (lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if (nlAt(ix, mid) < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static size_t countNewlines(textbuf *tb, int buf, size_t start, size_t len){
+  return lowerBound(&tb->nl[buf], start + len) - lowerBound(&tb->nl[buf], start);
+}
+
+static piece *newPiece(textbuf *tb, int buf, size_t start, size_t len){
+  piece *p = xrealloc(NULL, sizeof(piece));
+  p->l = p->r = NULL;
+  p->pri = rnd(tb);
+  p->buf = buf;
+  p->start = start;
+  p->len = p->sumlen = len;
+  p->nl = p->sumnl = countNewlines(tb, buf, start, len);
+  return p;
+}
+
+static void pull(piece *t){
+  t->sumlen = t->len;
+  t->sumnl = t->nl;
+  if (t->l){
+    t->sumlen += t->l->sumlen;
+    t->sumnl += t->l->sumnl;
+  }
+  if (t->r){
+    t->sumlen += t->r->sumlen;
+    t->sumnl += t->r->sumnl;
+  }
+}
+
+static piece *merge(piece *a, piece *b){
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (a->pri > b->pri){
+    a->r = merge(a->r, b);
+    pull(a);
+    return a;
+  }
+  b->l = merge(a, b->l);
+  pull(b);
+  return b;
+}
+
+// *a gets the first off bytes, *b the rest; a piece straddling off is cut in two
+static void split(textbuf *tb, piece *t, size_t off, piece **a, piece **b){
+  if (!t){
+    *a = *b = NULL;
+    return;
+  }
+  size_t left = t->l ? t->l->sumlen : 0;
+  if (off <= left){
+    split(tb, t->l, off, a, &t->l);
+    pull(t);
+    *b = t;
+  } else if (off >= left + t->len){
+    split(tb, t->r, off - left - t->len, &t->r, b);
+    pull(t);
+    *a = t;
+  } else{
+    size_t k = off - left;
+    piece *m = newPiece(tb, t->buf, t->start + k, t->len - k);
+    t->len = k;
+    t->nl -= m->nl;
+    *b = merge(m, t->r);
+    t->r = NULL;
+    pull(t);
+    *a = t;
+  }
+}
+
+// the piece holding byte pos grows by len bytes, nl of them newlines
+static void grow(piece *t, size_t pos, size_t len, size_t nl){
+  while (t){
+    size_t left = t->l ? t->l->sumlen : 0;
+    t->sumlen += len;
+    t->sumnl += nl;
+    if (pos < left){
+      t = t->l;
+    } else if (pos < left + t->len){
+      t->len += len;
+      t->nl += nl;
+      return;
+    } else{
+      pos -= left + t->len;
+      t = t->r;
+    }
+  }
+}
+
+static void freeTree(piece *t){
+  if (!t)
+    return;
+  freeTree(t->l);
+  freeTree(t->r);
+  free(t);
+}
+
+static size_t treeLength(textbuf *tb){
+  return tb->root ? tb->root->sumlen : 0;
+}
+
+/*** background indexing ***/
+
+static void *indexerMain(void *arg){
+  textbuf *tb = arg;
+  size_t pos = 0, n = 0;
+  int stop = 0;
+  while (pos < tb->origlen && !stop){
+    size_t len = tb->origlen - pos < INDEX_STEP ? tb->origlen - pos : INDEX_STEP;
+    n = indexNewlines(&tb->nl[ORIG], tb->data[ORIG], pos, len, n);
+    pos += len;
+
+    pthread_mutex_lock(&tb->lock);
+    tb->scanned = pos;
+    tb->found = n;
+    stop = tb->stop;
+    pthread_cond_broadcast(&tb->progress);
+    pthread_mutex_unlock(&tb->lock);
+  }
+  return NULL;
+}
+
+// move what the indexer has finished into the tree, first waiting until it
+// has scanned at least need bytes of the file (or all of it)
+static void catchUp(textbuf *tb, size_t need){
+  size_t scanned, found;
+  if (tb->tail == tb->origlen)
+    return;
+  if (need > tb->origlen)
+    need = tb->origlen;
+  pthread_mutex_lock(&tb->lock);
+  while (tb->scanned < need)
+    pthread_cond_wait(&tb->progress, &tb->lock);
+  scanned = tb->scanned;
+  found = tb->found;
+  pthread_mutex_unlock(&tb->lock);
+  if (scanned == tb->tail)
+    return;
+
+  tb->nl[ORIG].n = found;
+  size_t len = scanned - tb->tail;
+  piece *t = tb->root;
+  while (t && t->r)
+    t = t->r;
+  if (t && t->buf == ORIG && t->start + t->len == tb->tail)
+    grow(tb->root, treeLength(tb) - 1, len, countNewlines(tb, ORIG, tb->tail, len));
+  else
+    tb->root = merge(tb->root, newPiece(tb, ORIG, tb->tail, len));
+  tb->tail = scanned;
+}
+
+/*** buffer ***/
+
+static textbuf *tbNew(char *data, size_t len){
+  textbuf *tb = xrealloc(NULL, sizeof(textbuf));
+  memset(tb, 0, sizeof(textbuf));
+  tb->seed = 2463534242u;
+  tb->data[ORIG] = data;
+  tb->origlen = len;
+  tb->nl[ORIG].wide = len > UINT32_MAX; // fixed up front: the indexer thread fills it
+  return tb;
+}
+
+textbuf *tbCreate(char *data, size_t len){
+  textbuf *tb = tbNew(data, len);
+  if (len){
+    tb->nl[ORIG].n = indexNewlines(&tb->nl[ORIG], data, 0, len, 0);
+    tb->root = newPiece(tb, ORIG, 0, len);
+  }
+  tb->tail = len;
+  return tb;
+}
+
+textbuf *tbOpen(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1){
+    close(fd);
+    return NULL;
+  }
+
+  size_t len = st.st_size;
+  char *map = len && S_ISREG(st.st_mode) ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (map == MAP_FAILED){
+    // not mappable (empty, a pipe, ...): read it instead
+    size_t cap = len ? len : 4096;
+    char *data = xrealloc(NULL, cap);
+    ssize_t n;
+    len = 0;
+    while ((n = read(fd, data + len, cap - len)) > 0){
+      len += n;
+      if (len == cap)
+        data = xrealloc(data, cap *= 2);
+    }
+    close(fd);
+    return tbCreate(data, len);
+  }
+  close(fd);
+
+  textbuf *tb = tbNew(map, len);
+  tb->mapped = 1;
+  // every byte could be a newline: allocate the block table up front so
+  // the indexer never moves it
+  tb->nl[ORIG].nblk = len / NL_BLOCK + 1;
+  tb->nl[ORIG].blk = calloc(tb->nl[ORIG].nblk, sizeof(void *));
+  if (tb->nl[ORIG].blk == NULL)
+    abort();
+  pthread_mutex_init(&tb->lock, NULL);
+  pthread_cond_init(&tb->progress, NULL);
+  if (pthread_create(&tb->indexer, NULL, indexerMain, tb) == 0){
+    tb->threaded = 1;
+  } else{
+    indexerMain(tb);
+  }
+  return tb;
+}
+
+void tbFree(textbuf *tb){
+  if (!tb)
+    return;
+  if (tb->threaded){
+    pthread_mutex_lock(&tb->lock);
+    tb->stop = 1;
+    pthread_mutex_unlock(&tb->lock);
+    pthread_join(tb->indexer, NULL);
+  }
+  if (tb->mapped){
+    pthread_mutex_destroy(&tb->lock);
+    pthread_cond_destroy(&tb->progress);
+    munmap(tb->data[ORIG], tb->origlen);
+  } else{
+    free(tb->data[ORIG]);
+  }
+  free(tb->data[ADD]);
+  freeTree(tb->root);
+  for (int b = ORIG; b <= ADD; b++){
+    for (size_t k = 0; k < tb->nl[b].nblk; k++)
+      free(tb->nl[b].blk[k]);
+    free(tb->nl[b].blk);
+  }
+  free(tb);
+}
+
+int tbIndexing(textbuf *tb){
+  catchUp(tb, 0);
+  return tb->tail < tb->origlen;
+}
+
+void tbFinishIndex(textbuf *tb){
+  catchUp(tb, tb->origlen);
+}
+
+size_t tbLength(textbuf *tb){
+  return treeLength(tb) + tb->origlen - tb->tail;
+}
+
+size_t tbNewlines(textbuf *tb){
+  catchUp(tb, 0);
+  return tb->root ? tb->root->sumnl : 0;
+}
+
+size_t tbLineStart(textbuf *tb, size_t line){
+  size_t off = 0;
+  piece *t;
+  if (line == 0)
+    return 0;
+  while (line > tbNewlines(tb) && tb->tail < tb->origlen)
+    catchUp(tb, tb->tail + 1);
+
+  for (t = tb->root; t; ){
+    size_t lnl = t->l ? t->l->sumnl : 0;
+    if (line <= lnl){
+      t = t->l;
+      continue;
+    }
+    line -= lnl;
+    off += t->l ? t->l->sumlen : 0;
+    if (line <= t->nl){
+      struct nlindex *ix = &tb->nl[t->buf];
+      return off + nlAt(ix, lowerBound(ix, t->start) + line - 1) - t->start + 1;
+    }
+    line -= t->nl;
+    off += t->len;
+    t = t->r;
+  }
+  return tbLength(tb);
+}
+
+static void readTree(textbuf *tb, piece *t, size_t off, size_t len, char *dst){
+  while (t && len){
+    size_t left = t->l ? t->l->sumlen : 0;
+    if (off < left){
+      size_t k = left - off < len ? left - off : len;
+      readTree(tb, t->l, off, k, dst);
+      dst += k;
+      len -= k;
+      off = left;
+    }
+    if (len && off < left + t->len){
+      size_t p = off - left;
+      size_t k = t->len - p < len ? t->len - p : len;
+      memcpy(dst, tb->data[t->buf] + t->start + p, k);
+      dst += k;
+      len -= k;
+      off += k;
+    }
+    off -= left + t->len;
+    t = t->r;
+  }
+}
+
+size_t tbRead(textbuf *tb, size_t off, size_t len, char *dst){
+  size_t total = tbLength(tb), tree = treeLength(tb);
+  if (off >= total)
+    return 0;
+  if (len > total - off)
+    len = total - off;
+  size_t k = off < tree ? (tree - off < len ? tree - off : len) : 0;
+  readTree(tb, tb->root, off, k, dst);
+  if (k < len) // the part not indexed yet is straight from the file
+    memcpy(dst + k, tb->data[ORIG] + tb->tail + (off + k - tree), len - k);
+  return len;
+}
+
+// edits go into the tree: index at least up to end first
+static void reach(textbuf *tb, size_t end){
+  while (end > treeLength(tb) && tb->tail < tb->origlen)
+    catchUp(tb, tb->tail + (end - treeLength(tb)));
+}
+
+void tbInsert(textbuf *tb, size_t off, const char *s, size_t len){
+  if (len == 0)
+    return;
+  if (off > tbLength(tb))
+    off = tbLength(tb);
+  reach(tb, off);
+
+  size_t start = tb->addlen;
+  if (tb->addlen + len > tb->addcap){
+    tb->addcap = tb->addcap ? tb->addcap : 4096;
+    while (tb->addlen + len > tb->addcap)
+      tb->addcap *= 2;
+    tb->data[ADD] = xrealloc(tb->data[ADD], tb->addcap);
+  }
+  memcpy(tb->data[ADD] + start, s, len);
+  tb->addlen += len;
+  tb->nl[ADD].n = indexNewlines(&tb->nl[ADD], tb->data[ADD], start, len, tb->nl[ADD].n);
+
+  // typing: the new bytes follow the previous ones in both the text and the add buffer
+  if (tb->last && off == tb->lastend && tb->last->start + tb->last->len == start){
+    grow(tb->root, off - 1, len, countNewlines(tb, ADD, start, len));
+  } else{
+    piece *a, *b;
+    split(tb, tb->root, off, &a, &b);
+    tb->last = newPiece(tb, ADD, start, len);
+    tb->root = merge(merge(a, tb->last), b);
+  }
+  tb->lastend = off + len;
+}
+
+void tbDelete(textbuf *tb, size_t off, size_t len){
+  piece *a, *b, *c;
+  if (len == 0 || off >= tbLength(tb))
+    return;
+  reach(tb, off + len);
+  split(tb, tb->root, off, &a, &b);
+  split(tb, b, len, &b, &c);
+  freeTree(b);
+  tb->root = merge(a, c);
+  tb->last = NULL;
+}
+
+/*** writing ***/
+
+// gathers spans of the buffers into iovecs for writev
+struct writer{
+  int fd;
+  int flags;
+  int err;
+  int n;
+  struct iovec iov[WRITE_IOVS];
+  char copy[WRITE_IOVS * WRITE_COPY];
+  size_t copied;
+  size_t total;
+  size_t cr;          // '\r's not written yet: dropped if a '\n' follows
+  char last;
+};
+
+static void wrFlush(struct writer *w){
+  struct iovec *v = w->iov;
+  int n = w->n;
+  while (n && !w->err){
+    ssize_t k = writev(w->fd, v, n);
+    if (k == -1){
+      if (errno != EINTR)
+        w->err = errno;
+      continue;
+    }
+    for (; n && (size_t)k >= v->iov_len; v++, n--)
+      k -= v->iov_len;
+    if (n){
+      v->iov_base = (char *)v->iov_base + k;
+      v->iov_len -= k;
+    }
+  }
+  w->n = 0;
+  w->copied = 0;
+}
+
+static void wrAdd(struct writer *w, const char *p, size_t len){
+  if (len == 0)
+    return;
+  if (w->n == WRITE_IOVS || (len < WRITE_COPY && w->copied + len > sizeof(w->copy)))
+    wrFlush(w);
+  if (len < WRITE_COPY){
+    // short pieces (CRLF split into lines, typing) go out in one iovec
+    char *dst = w->copy + w->copied;
+    memcpy(dst, p, len);
+    w->copied += len;
+    if (w->n && (char *)w->iov[w->n - 1].iov_base + w->iov[w->n - 1].iov_len == dst){
+      w->iov[w->n - 1].iov_len += len;
+    } else{
+      w->iov[w->n].iov_base = dst;
+      w->iov[w->n].iov_len = len;
+      w->n++;
+    }
+  } else{
+    w->iov[w->n].iov_base = (void *)p;
+    w->iov[w->n].iov_len = len;
+    w->n++;
+  }
+  w->total += len;
+  w->last = p[len - 1];
+}
+
+static void wrSpan(struct writer *w, const char *p, size_t len){
+  static const char crs[] = "\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r\r";
+  const char *end = p + len;
+  if (!(w->flags & TB_LF)){
+    wrAdd(w, p, len);
+    return;
+  }
+  while (p < end){
+    for (; p < end && *p == '\r'; p++)
+      w->cr++;
+    if (p == end)
+      break;
+    while (w->cr && *p != '\n'){ // not a line break after all
+      size_t k = w->cr < sizeof(crs) - 1 ? w->cr : sizeof(crs) - 1;
+      wrAdd(w, crs, k);
+      w->cr -= k;
+    }
+    w->cr = 0;
+    const char *r = memchr(p, '\r', end - p);
+    if (r == NULL)
+      r = end;
+    wrAdd(w, p, r - p);
+    p = r;
+  }
+}
+
+static void wrTree(textbuf *tb, piece *t, struct writer *w){
+  for (; t; t = t->r){
+    wrTree(tb, t->l, w);
+    wrSpan(w, tb->data[t->buf] + t->start, t->len);
+  }
+}
+
+ssize_t tbWrite(textbuf *tb, int fd, int flags){
+  struct writer *w = xrealloc(NULL, sizeof(struct writer));
+  ssize_t total;
+  memset(w, 0, sizeof(struct writer));
+  w->fd = fd;
+  w->flags = flags;
+  w->last = '\n';
+  wrTree(tb, tb->root, w);
+  wrSpan(w, tb->data[ORIG] + tb->tail, tb->origlen - tb->tail);
+  // '\r's left at the very end go too, but the row they make (see
+  // editorCountRows) still ends in a line break: "a\n\r" is "a\n\n"
+  if ((w->flags & TB_LF) && (w->cr || w->last != '\n'))
+    wrAdd(w, "\n", 1);
+  wrFlush(w);
+
+  total = w->total;
+  if (w->err){
+    errno = w->err;
+    total = -1;
+  }
+  free(w);
+  return total;
+}
@@ -0,0 +1,42 @@
+#ifndef JEL_BUF_H
+#define JEL_BUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// piece table: the file as loaded (never modified) plus an append-only
+// buffer of everything typed since. the text is the in-order sequence of
+// pieces, kept in a treap whose nodes carry the byte and newline counts of
+// their subtree, so offset and line lookups, inserts and deletes are
+// O(log pieces). each buffer keeps a sorted array of its newline offsets,
+// which answers "k-th newline inside a piece" with one binary search.
+//
+// tbOpen maps the file instead of reading it and indexes its newlines on a
+// thread. the tree covers the part indexed so far and the rest of the file
+// follows it; calls that need lines or edits further on wait for the
+// indexer to get there.
+
+typedef struct textbuf textbuf;
+
+textbuf *tbCreate(char *data, size_t len); // takes ownership of data (malloc'd, may be NULL)
+textbuf *tbOpen(const char *filename);     // NULL with errno set
+void tbFree(textbuf *tb);
+
+int tbIndexing(textbuf *tb);               // newlines past tbNewlines() may still turn up
+void tbFinishIndex(textbuf *tb);
+
+size_t tbLength(textbuf *tb);
+size_t tbNewlines(textbuf *tb);               // found so far while indexing
+size_t tbLineStart(textbuf *tb, size_t line); // offset just past the line-th newline
+size_t tbRead(textbuf *tb, size_t off, size_t len, char *dst);
+
+void tbInsert(textbuf *tb, size_t off, const char *s, size_t len);
+void tbDelete(textbuf *tb, size_t off, size_t len);
+
+// write the text to fd, gathered straight from the buffers with writev.
+// TB_LF drops the '\r' of each "\r\n" (and any at the very end) and ends
+// the text with a '\n'. returns the bytes written, or -1 with errno set
+#define TB_LF 1
+ssize_t tbWrite(textbuf *tb, int fd, int flags);
+
+#endif
@@ -0,0 +1,18 @@
+; add/and/not/br loop: 6 ALU ops and a branch per inner iteration
+        .ORIG x3000
+        AND R0,R0,#0
+        LD R1,OUTER
+OL      LD R2,INNER
+IL      ADD R0,R0,#3
+        AND R3,R0,#15
+        ADD R4,R3,R2
+        NOT R5,R4
+        ADD R2,R2,#-1
+        BRp IL
+        ADD R1,R1,#-1
+        BRp OL
+        OUTU16
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #10000
+        .END
@@ -0,0 +1,205 @@
+// Benchmark driver: runs each image on each core and reports MIPS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../vm.h"
+#include "../vm_load.h"
+#include "../vm_prof.h"
+#include "../vm_snap.h"
+
+static const char *core_names[] = { "table", "cached", "threaded", "jit" };
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Console streams go nowhere: output is dropped, input is at EOF
+static void quiet(struct lc3_vm *vm) {
+    kbd_init(&vm->io, -1, false);
+    out_init(&vm->io, -1, 0);
+}
+
+// Instructions one run executes, counted once with the profiler
+static uint64_t count_instructions(struct lc3_vm *vm, const struct lc3_snap *snap) {
+    uint64_t total = 0;
+    vm_restore(vm, snap);
+    if ((vm->prof = prof_create(vm->pc_start)) == NULL) {
+        return 0;
+    }
+    quiet(vm);
+    start(vm, 0x0);
+    out_close(&vm->io);
+    for (int o = 0; o < NOPS; o++) total += vm->prof->op[o];
+    prof_destroy(vm->prof);
+    vm->prof = NULL;
+    return total;
+}
+
+static void bench(const char *image, int runs, const bool *cores) {
+    struct lc3_vm *vm = vm_create();
+    uint16_t origin;
+    if (vm == NULL || ld_obj(vm, image, &origin) < 0) {
+        vm_destroy(vm);
+        return;
+    }
+    vm->pc_start = origin;
+    struct lc3_snap *snap = vm_snapshot(vm);
+    uint64_t instrs = snap ? count_instructions(vm, snap) : 0;
+    if (instrs == 0) {
+        fprintf(stderr, "%s: could not count instructions\n", image);
+        vm_snap_free(snap);
+        vm_destroy(vm);
+        return;
+    }
+
+    double *ms = malloc(runs * sizeof(double));
+    for (int c = CORE_TABLE; ms && c <= CORE_JIT; c++) {
+        if (!cores[c]) continue;
+        vm->core = c;
+
+        // One untimed run to fault in pages and warm caches and the JIT
+        for (int r = -1; r < runs; r++) {
+            vm_restore(vm, snap);
+            quiet(vm);
+            double t0 = now_ms();
+            start(vm, 0x0);
+            out_close(&vm->io);
+            if (r >= 0) ms[r] = now_ms() - t0;
+        }
+
+        double sum = 0, best = ms[0];
+        for (int r = 0; r < runs; r++) {
+            sum += ms[r];
+            if (ms[r] < best) best = ms[r];
+        }
+        double mean = sum / runs, var = 0;
+        for (int r = 0; r < runs; r++) var += (ms[r] - mean) * (ms[r] - mean);
+        double sd = runs > 1 ? sqrt(var / (runs - 1)) : 0;
+
+        printf("%-16s %-8s %12llu %10.3f %10.3f %7.2f%% %9.1f %8.3f\n", image, core_names[c],
+               (unsigned long long)instrs, mean, best, mean > 0 ? 100 * sd / mean : 0,
+               instrs / (mean * 1e3), mean * 1e6 / instrs);
+    }
+
+    free(ms);
+    vm_snap_free(snap);
+    vm_destroy(vm);
+}
+
+// Empty the image cache directory
+static void clear_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    char path[4096];
+    while (d && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if (d) closedir(d);
+}
+
+// ld_obj() of a full-memory object: without the image cache, on a miss
+// (which also fills it) and on a hit
+static void bench_load(int runs) {
+    char dir[] = "/tmp/lc3-bench-XXXXXX", obj[64], cache[64];
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    snprintf(obj, sizeof(obj), "%s/full.obj", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    mkdir(cache, 0755);
+
+    size_t bytes = 2 * (1 + MEM_WORDS - 0x3000);
+    uint8_t *img = malloc(bytes);
+    FILE *f = fopen(obj, "wb");
+    if (img == NULL || f == NULL) {
+        perror(obj);
+        free(img);
+        if (f) fclose(f);
+        return;
+    }
+    for (size_t k = 0; k < bytes; k++) img[k] = rand();
+    img[0] = 0x30;
+    img[1] = 0x00;
+    fwrite(img, 1, bytes, f);
+    fclose(f);
+    free(img);
+
+    struct lc3_vm *vm = vm_create();
+    const char *modes[] = { "no cache", "miss", "hit" };
+    runs *= 20;
+    for (int m = 0; vm && m < 3; m++) {
+        ld_cache_dir(m ? cache : NULL);
+        double sum = 0, best = 0;
+        for (int r = -1; r < runs; r++) {
+            uint16_t origin;
+            if (m == 1) clear_dir(cache);
+            double t0 = now_ms();
+            ld_obj(vm, obj, &origin);
+            double ms = now_ms() - t0;
+            if (r < 0) continue;
+            sum += ms;
+            if (r == 0 || ms < best) best = ms;
+        }
+        printf("%-16s %-8s %12zu %10.3f %10.3f\n", "load full.obj", modes[m], bytes,
+               sum / runs, best);
+    }
+    ld_cache_dir(NULL);
+    vm_destroy(vm);
+    clear_dir(cache);
+    rmdir(cache);
+    unlink(obj);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    bool cores[4] = { true, true, true, true };
+    int nimages = 0;
+    bool load = false;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--runs") == 0) && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1) runs = 1;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cores") == 0) && i + 1 < argc) {
+            // Comma separated list of core names
+            char *list = argv[++i];
+            memset(cores, 0, sizeof(cores));
+            for (int c = 0; c < 4; c++) {
+                cores[c] = strstr(list, core_names[c]) != NULL;
+            }
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--load") == 0) {
+            load = true;
+        } else {
+            argv[++nimages] = argv[i];
+        }
+    }
+    if (load) {
+        printf("%-16s %-8s %12s %10s %10s\n", "workload", "cache", "bytes", "mean ms", "best ms");
+        bench_load(runs);
+        return 0;
+    }
+    if (nimages == 0) {
+        fprintf(stderr, "Usage: %s [-n runs] [-c table,cached,threaded,jit] <object-file>...\n"
+                        "       %s [-n runs] -l\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    printf("%-16s %-8s %12s %10s %10s %8s %9s %8s\n",
+           "workload", "core", "instrs", "mean ms", "best ms", "stdev", "MIPS", "ns/inst");
+    for (int k = 1; k <= nimages; k++) {
+        bench(argv[k], runs, cores);
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+; naive recursive fib(27): jsr/ret with a memory stack
+        .ORIG x3000
+        LD R6,STK
+        LD R0,N
+        JSR FIB
+        OUTU16
+        HALT
+STK     .FILL xF000
+N       .FILL #27
+; R0=n -> R0=fib(n)
+FIB     ADD R1,R0,#-2
+        BRzp REC
+        RET
+REC     ADD R6,R6,#-1
+        STR R7,R6,#0
+        ADD R6,R6,#-1
+        STR R0,R6,#0
+        ADD R0,R0,#-1
+        JSR FIB
+        LDR R1,R6,#0
+        STR R0,R6,#0
+        ADD R0,R1,#-2
+        JSR FIB
+        LDR R1,R6,#0
+        ADD R0,R0,R1
+        ADD R6,R6,#1
+        LDR R7,R6,#0
+        ADD R6,R6,#1
+        RET
+        .END
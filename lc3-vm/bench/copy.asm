@@ -0,0 +1,24 @@
+; ldr/str copy of a 200-word block, repeated
+        .ORIG x3000
+        LD R4,REPS
+RL      LEA R1,SRC
+        LD R2,DSTP
+        LD R3,CNT
+CL      LDR R0,R1,#0
+        STR R0,R2,#0
+        ADD R1,R1,#1
+        ADD R2,R2,#1
+        ADD R3,R3,#-1
+        BRp CL
+        ADD R4,R4,#-1
+        BRp RL
+        LDI R0,DSTP
+        OUTU16
+        HALT
+REPS    .FILL #10000
+DSTP    .FILL x5000
+CNT     .FILL #200
+SRC     .FILL #7
+        .FILL #8
+        .BLKW #198
+        .END
@@ -0,0 +1,19 @@
+; console output through PUTS, OUT and PUTSP
+        .ORIG x3000
+        LD R1,N
+L       LEA R0,MSG
+        PUTS
+        LD R0,CH
+        OUT
+        LEA R0,PK
+        PUTSP
+        ADD R1,R1,#-1
+        BRp L
+        HALT
+N       .FILL #30000
+CH      .FILL x41
+MSG     .STRINGZ "hello, lc3 world "
+PK      .FILL x6968
+        .FILL x0a21
+        .FILL 0
+        .END
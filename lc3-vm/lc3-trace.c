@@ -0,0 +1,97 @@
+// Decoder for the binary memory traces written by lc3-vm -m
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "vm_trace.h"
+#include "vm_dbg.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <trace-file>\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -a, --addr <from>[-<to>]  Only accesses to addresses in the range\n");
+    fprintf(stderr, "  -p, --pc <from>[-<to>]    Only accesses made by instructions in the range\n");
+    fprintf(stderr, "  -r, --reads               Only reads\n");
+    fprintf(stderr, "  -w, --writes              Only writes\n");
+    fprintf(stderr, "  -l, --long                Include PC, instruction and old value\n");
+}
+
+// "0x3000", "0x3000-0x30FF" or "3000-30ff" (hex either way)
+static bool parse_range(const char *s, uint16_t *from, uint16_t *to) {
+    char *end;
+    unsigned long a = strtoul(s, &end, 16), b = a;
+    if (end == s) return false;
+    if (*end == '-') {
+        s = end + 1;
+        b = strtoul(s, &end, 16);
+        if (end == s) return false;
+    }
+    if (*end || a > 0xFFFF || b > 0xFFFF || a > b) return false;
+    *from = a;
+    *to = b;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint16_t addr_lo = 0, addr_hi = 0xFFFF, pc_lo = 0, pc_hi = 0xFFFF;
+    bool reads = true, writes = true, lng = false;
+    char *file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--addr") == 0) && i + 1 < argc) {
+            if (!parse_range(argv[++i], &addr_lo, &addr_hi)) { usage(argv[0]); return 1; }
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pc") == 0) && i + 1 < argc) {
+            if (!parse_range(argv[++i], &pc_lo, &pc_hi)) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--reads") == 0) {
+            writes = false;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--writes") == 0) {
+            reads = false;
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--long") == 0) {
+            lng = true;
+        } else if (file == NULL) {
+            file = argv[i];
+        }
+    }
+    if (file == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(file, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", file);
+        return 1;
+    }
+    struct trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 4) != 0 ||
+        hdr.version != TRACE_VERSION || hdr.rec_size != sizeof(struct trace_rec)) {
+        fprintf(stderr, "%s is not an lc3-vm trace\n", file);
+        fclose(in);
+        return 1;
+    }
+
+    static struct trace_rec buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(struct trace_rec), 4096, in)) > 0) {
+        for (size_t k = 0; k < n; k++) {
+            const struct trace_rec *r = &buf[k];
+            if (r->addr < addr_lo || r->addr > addr_hi || r->pc < pc_lo || r->pc > pc_hi) continue;
+            if (r->kind == TRACE_READ ? !reads : !writes) continue;
+
+            if (lng) {
+                printf("0x%04X 0x%04X %-4s ", r->pc, r->instr, op_names[r->instr >> 12]);
+            }
+            if (r->kind == TRACE_READ) {
+                printf("MEM READ:  [0x%04X] -> 0x%04X\n", r->addr, r->val);
+            } else if (lng) {
+                printf("MEM WRITE: [0x%04X] <- 0x%04X (was 0x%04X)\n", r->addr, r->val, r->old);
+            } else {
+                printf("MEM WRITE: [0x%04X] <- 0x%04X\n", r->addr, r->val);
+            }
+        }
+    }
+    fclose(in);
+    return 0;
+}
@@ -6,64 +6,21 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
-#include <sys/mman.h>
 
+#include "vm.h"
 #include "vm_dbg.h"
-
-// Configuration and Debug Options
-#define NOPS (16)                      // Number of operations
-#define DEBUG_MODE 0                   // Set to 1 to enable debug output
-#define MEMORY_TRACE 0                 // Set to 1 to enable memory access tracing
-#define MEMORY_PROTECTION 1            // Set to 1 to enable memory protection
-
-// Memory-mapped I/O addresses
-#define KBSR 0xFE00                    // Keyboard status register
-#define KBDR 0xFE02                    // Keyboard data register
-#define DSR 0xFE04                     // Display status register
-#define DDR 0xFE06                     // Display data register
-#define MCR 0xFFFE                     // Machine control register
-
-// Memory protection
-#define MEM_PROTECTED_START 0x0000
-#define MEM_PROTECTED_END   0x2FFF
-
-// Instruction parsing macros
-#define OPC(i) ((i)>>12)               // Extract operation code (bits 15-12)
-#define DR(i) (((i)>>9)&0x7)           // Extract destination register (bits 11-9)
-#define SR1(i) (((i)>>6)&0x7)          // Extract first source register (bits 8-6)
-#define SR2(i) ((i)&0x7)               // Extract second source register (bits 2-0)
-#define FIMM(i) ((i>>5)&01)            // Extract immediate mode flag (bit 5)
-#define IMM(i) ((i)&0x1F)              // Extract immediate value (bits 4-0)
-#define SEXTIMM(i) sext(IMM(i),5)      // Sign-extend immediate value
-#define FCND(i) (((i)>>9)&0x7)         // Extract condition flags (bits 11-9)
-#define POFF(i) sext((i)&0x3F, 6)      // Extract and sign-extend 6-bit offset
-#define POFF9(i) sext((i)&0x1FF, 9)    // Extract and sign-extend 9-bit offset
-#define POFF11(i) sext((i)&0x7FF, 11)  // Extract and sign-extend 11-bit offset
-#define FL(i) (((i)>>11)&1)            // Extract addressing mode flag (bit 11)
-#define BR(i) (((i)>>6)&0x7)           // Extract base register (bits 8-6)
-#define TRP(i) ((i)&0xFF)              // Extract trap vector (bits 7-0)
-
-// VM state
-bool running = true;
-bool debug_mode = DEBUG_MODE;
-bool memory_trace = MEMORY_TRACE;
-
-// Function type definitions
-typedef void (*op_ex_f)(uint16_t i);
-typedef void (*trp_ex_f)();
-
-// Constants and enumerations
-enum { trp_offset = 0x20 };            // Trap vector offset
-enum regist { R0 = 0, R1, R2, R3, R4, R5, R6, R7, RPC, RCND, RCNT };
-enum flags { FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
-
-// Memory and registers
-uint16_t mem[UINT16_MAX] = {0};
-uint16_t reg[RCNT] = {0};
-uint16_t PC_START = 0x3000;
+#include "vm_io.h"
+#include "vm_load.h"
+#include "vm_prof.h"
+#include "vm_replay.h"
+#include "vm_trace.h"
+#include "vm_batch.h"
+#include "vm_sched.h"
+#include "vm_gdb.h"
+#include "vm_asm.h"
 
 // Original terminal settings
 struct termios original_tio;
@@ -86,287 +43,336 @@ void handle_interrupt(int signal) {
     exit(-2);
 }
 
-// Check if key is pressed
-uint16_t check_key() {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+static bool is_asm(const char *fname) {
+    size_t n = strlen(fname);
+    return n > 4 && strcmp(fname + n - 4, ".asm") == 0;
 }
 
-// Memory access functions with safety checks
-static inline uint16_t mr(uint16_t address) {
-    // Handle memory-mapped I/O
-    if (address == KBSR) {
-        if (check_key()) {
-            mem[KBSR] = (1 << 15);
-            mem[KBDR] = getchar();
-        } else {
-            mem[KBSR] = 0;
+// Raw image first, then object files at their origins. Without an image
+// the first object file's origin is the entry point. Files ending in .asm
+// are assembled in place; an assembled image starts at its .ORIG.
+static bool load(struct lc3_vm *vm, const char *image_file, char **objs, int nobjs, bool verbose) {
+    if (image_file) {
+        uint16_t origin = vm->pc_start;
+        bool src = is_asm(image_file);
+        long words = src ? asm_file(vm, image_file, &origin) : ld_img(vm, image_file, 0x0);
+        if (words < 0) {
+            return false;
         }
+        if (verbose) {
+            printf("Successfully %s image file '%s' (%ld words)\n", src ? "assembled" : "loaded", image_file, words);
+        }
+        vm->pc_start = origin;
     }
-    
-    if (memory_trace) {
-        fprintf(stderr, "MEM READ:  [0x%04X] -> 0x%04X\n", address, mem[address]);
-    }
-    
-    return mem[address];
-}
-
-static inline void mw(uint16_t address, uint16_t val) {
-    if (MEMORY_PROTECTION && address >= MEM_PROTECTED_START && address <= MEM_PROTECTED_END) {
-        fprintf(stderr, "Memory protection error: Cannot write to protected address 0x%04X\n", address);
-        return;
-    }
-    
-    // Handle memory-mapped I/O
-    if (address == DDR) {
-        putchar((char)val);
-        fflush(stdout);
-    } else if (address == MCR) {
-        if ((val & (1 << 15)) == 0) {
-            running = false;
+    for (int k = 0; k < nobjs; k++) {
+        uint16_t origin;
+        bool src = is_asm(objs[k]);
+        long words = src ? asm_file(vm, objs[k], &origin) : ld_obj(vm, objs[k], &origin);
+        if (words < 0) {
+            return false;
         }
-    } else {
-        if (memory_trace) {
-            fprintf(stderr, "MEM WRITE: [0x%04X] <- 0x%04X\n", address, val);
+        if (verbose) {
+            printf("Successfully %s %s file '%s' at 0x%04X (%ld words)\n",
+                   src ? "assembled" : "loaded", src ? "source" : "object", objs[k], origin, words);
+        }
+        if (image_file == NULL && k == 0) {
+            vm->pc_start = origin;
         }
-        mem[address] = val;
     }
+    return true;
 }
 
-// Sign extension function
-static inline uint16_t sext(uint16_t n, int b) { 
-    return ((n>>(b-1))&1) ? (n|(0xFFFF << b)) : n; 
-}
-
-// Update flags based on register value
-static inline void uf(enum regist r) {
-    if (reg[r]==0) reg[RCND] = FZ;
-    else if (reg[r]>>15) reg[RCND] = FN;
-    else reg[RCND] = FP;
-}
-
-// Instruction implementations
-static inline void add(uint16_t i)  { reg[DR(i)] = reg[SR1(i)] + (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(DR(i)); }
-static inline void and(uint16_t i)  { reg[DR(i)] = reg[SR1(i)] & (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(DR(i)); }
-static inline void ldi(uint16_t i)  { reg[DR(i)] = mr(mr(reg[RPC]+POFF9(i))); uf(DR(i)); }
-static inline void not(uint16_t i)  { reg[DR(i)]=~reg[SR1(i)]; uf(DR(i)); }
-static inline void br(uint16_t i)   { if (reg[RCND] & FCND(i)) { reg[RPC] += POFF9(i); } }
-static inline void jsr(uint16_t i)  { reg[R7] = reg[RPC]; reg[RPC] = (FL(i)) ? reg[RPC] + POFF11(i) : reg[BR(i)]; }
-static inline void jmp(uint16_t i)  { reg[RPC] = reg[BR(i)]; }
-static inline void ld(uint16_t i)   { reg[DR(i)] = mr(reg[RPC] + POFF9(i)); uf(DR(i)); }
-static inline void ldr(uint16_t i)  { reg[DR(i)] = mr(reg[SR1(i)] + POFF(i)); uf(DR(i)); }
-static inline void lea(uint16_t i)  { reg[DR(i)] = reg[RPC] + POFF9(i); uf(DR(i)); }
-static inline void st(uint16_t i)   { mw(reg[RPC] + POFF9(i), reg[DR(i)]); }
-static inline void sti(uint16_t i)  { mw(mr(reg[RPC] + POFF9(i)), reg[DR(i)]); }
-static inline void str(uint16_t i)  { mw(reg[SR1(i)] + POFF(i), reg[DR(i)]); }
-static inline void rti(uint16_t i) { fprintf(stderr, "RTI instruction not implemented\n"); }
-static inline void res(uint16_t i) { fprintf(stderr, "Reserved opcode used\n"); }
-
-// Trap routines
-static inline void tgetc() { 
-    reg[R0] = getchar(); 
-}
-
-static inline void tout() { 
-    fprintf(stdout, "%c", (char)reg[R0]); 
-    fflush(stdout);
-}
-
-static inline void tputs() {
-    uint16_t addr = reg[R0];
-    // Add bounds checking
-    if (addr >= UINT16_MAX) {
-        fprintf(stderr, "Error: Invalid memory address in PUTS trap\n");
-        return;
-    }
-    
-    uint16_t *p = mem + addr;
-    while(*p && p < mem + UINT16_MAX) {
-        fprintf(stdout, "%c", (char)*p);
-        p++;
+// Headless run: input from a file or pipe without a reader thread, output
+// captured, one binary result record on stdout. Never touches the terminal.
+static int run_batch(struct lc3_vm *vm, bool loaded, int in_fd) {
+    struct timespec t0, t1;
+    uint16_t flags = RESULT_LOAD_FAIL;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    out_init(&vm->io, -1, 0);
+    out_capture(&vm->io);
+    if (loaded) {
+        kbd_init(&vm->io, in_fd, false);
+        start(vm, 0x0);
+        out_flush(&vm->io);
+        flags = vm->running ? 0 : RESULT_HALTED;
+        if (vm->replay && replay_failed(vm->replay)) {
+            flags = RESULT_REPLAY_FAIL;    // Stopped by the log, not the program
+        }
     }
-    fflush(stdout);
-}
+    clock_gettime(CLOCK_MONOTONIC, &t1);
 
-static inline void tin() { 
-    reg[R0] = getchar(); 
-    fprintf(stdout, "%c", (char)reg[R0]); 
-    fflush(stdout);
+    uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+    int rc = batch_write(STDOUT_FILENO, vm, flags, ns) < 0 || !loaded;
+    vm_destroy(vm);
+    return rc;
 }
 
-static inline void tputsp() {
-    uint16_t addr = reg[R0];
-    if (addr >= UINT16_MAX) {
-        fprintf(stderr, "Error: Invalid memory address in PUTSP trap\n");
+// Hot-spot report to file, folded call stacks to file.folded
+static void write_profile(struct lc3_vm *vm, const char *file) {
+    char path[4096];
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", file);
         return;
     }
-    
-    uint16_t *p = mem + addr;
-    while (*p && p < mem + UINT16_MAX) {
-        char c1 = (*p) & 0xFF;
-        fprintf(stdout, "%c", c1);
-        
-        char c2 = (*p) >> 8;
-        if (c2) fprintf(stdout, "%c", c2);
-        
-        p++;
-    }
-    fflush(stdout);
-}
-
-static inline void thalt() { 
-    running = false; 
-    printf("\nHALT instruction executed\n");
-}
+    prof_report(f, vm->prof, vm->mem, vm->syms, 50);
+    fclose(f);
 
-static inline void tinu16() { 
-    fscanf(stdin, "%hu", &reg[R0]); 
-}
-
-static inline void toutu16() { 
-    fprintf(stdout, "%hu\n", reg[R0]); 
-    fflush(stdout);
-}
-
-// Trap execution table
-trp_ex_f trp_ex[8] = { tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16 };
-
-static inline void trap(uint16_t i) { 
-    uint8_t trapcode = TRP(i)-trp_offset;
-    if (trapcode >= 8) {
-        fprintf(stderr, "Invalid trap code: 0x%02X\n", TRP(i));
+    snprintf(path, sizeof(path), "%s.folded", file);
+    if ((f = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
         return;
     }
-    trp_ex[trapcode](); 
+    prof_folded(f, vm->prof, vm->syms);
+    fclose(f);
 }
 
-// Operation execution table
-op_ex_f op_ex[NOPS] = { /*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi, sti, jmp, res, lea, trap };
-
-// Debug function to print instruction details
-void debug_instruction(uint16_t pc, uint16_t instr) {
-    const char* op_names[] = {
-        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
-        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
-    };
-    
-    fprintf(stderr, "PC: 0x%04X, Instr: 0x%04X, Op: %s\n", 
-            pc, instr, op_names[OPC(instr)]);
-    
-    fprintf(stderr, "Registers: ");
-    for (int i = 0; i <= R7; i++) {
-        fprintf(stderr, "R%d=0x%04X ", i, reg[i]);
+// Run every image on a thread pool. Each one reads <image>.in (if present)
+// and writes its console output to <image>.out.
+static int run_pool(char **images, int nimages, int threads, enum vm_core core) {
+    struct lc3_job *jobs = calloc(nimages, sizeof(struct lc3_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
     }
-    fprintf(stderr, "\n");
-}
 
-// Main VM execution loop
-void start(uint16_t offset) { 
-    reg[RPC] = PC_START + offset;
-    
-    while(running) {
-        uint16_t pc = reg[RPC];
-        uint16_t i = mr(reg[RPC]++);
-        
-        if (debug_mode) {
-            debug_instruction(pc, i);
-            
-            // Optional: Wait for key press to continue in debug mode
-            if (getchar() == 'q') {
-                printf("Debug mode: quitting\n");
-                break;
-            }
+    char path[4096];
+    for (int k = 0; k < nimages; k++) {
+        jobs[k].image = images[k];
+        snprintf(path, sizeof(path), "%s.in", images[k]);
+        jobs[k].in_fd = open(path, O_RDONLY);
+        snprintf(path, sizeof(path), "%s.out", images[k]);
+        jobs[k].out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (jobs[k].out_fd < 0) {
+            fprintf(stderr, "Cannot open %s, output discarded\n", path);
         }
-        
-        op_ex[OPC(i)](i);
     }
-}
 
-// Load program from file
-void ld_img(char *fname, uint16_t offset) {
-    FILE *in = fopen(fname, "rb");
-    if (NULL==in) {
-        fprintf(stderr, "Cannot open file %s.\n", fname);
-        exit(1);    
-    }
-    
-    uint16_t *p = mem + PC_START + offset;
-    size_t read = fread(p, sizeof(uint16_t), (UINT16_MAX-PC_START), in);
-    
-    if (read == 0) {
-        fprintf(stderr, "Error: Could not read from file %s\n", fname);
-        fclose(in);
-        exit(1);
-    }
-    
-    // Endian conversion (LC-3 is big endian)
-    #if defined(__LITTLE_ENDIAN__) || defined(__LITTLE_ENDIAN) || \
-        (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-    uint16_t *curr = p;
-    while (curr < p + read) {
-        *curr = (*curr << 8) | (*curr >> 8);  // Swap bytes
-        curr++;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int failed = sched_run(jobs, nimages, threads, core);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int k = 0; k < nimages; k++) {
+        struct lc3_job *job = &jobs[k];
+        if (job->loaded) {
+            printf("%s: PC=0x%04X R0=0x%04X %.3f ms\n", job->image,
+                   job->reg[RPC], job->reg[R0], job->ns / 1e6);
+        } else {
+            printf("%s: not loaded\n", job->image);
+        }
+        if (job->in_fd >= 0) close(job->in_fd);
+        if (job->out_fd >= 0) close(job->out_fd);
     }
-    #endif
-    
-    fclose(in);
-    
-    printf("Successfully loaded image file '%s' (%zu words)\n", fname, read);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%d images on %d threads in %.3f s (%.1f images/s)\n",
+            nimages, threads, secs, secs > 0 ? nimages / secs : 0.0);
+
+    free(jobs);
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
     // Handle command line arguments
     bool debug_flag = false;
-    bool memory_trace_flag = false;
-    char *image_file = NULL;
+    char *trace_file = NULL;
+    unsigned flush_ms = OUT_FLUSH_MS;
+    enum vm_core core = CORE_TABLE;
+    int threads = 0;
+    char **images = calloc(argc, sizeof(char *));
+    int nimages = 0;
+    char **objs = calloc(argc, sizeof(char *));
+    int nobjs = 0;
+    char *profile_file = NULL;
+    bool batch = false;
+    char *input_file = NULL;
+    bool supervisor = false;
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    char *gdb_target = NULL;
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
             debug_flag = true;
-        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memory-trace") == 0) {
-            memory_trace_flag = true;
-        } else if (image_file == NULL) {
-            image_file = argv[i];
+        } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memory-trace") == 0) && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cached") == 0) {
+            core = CORE_CACHED;
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threaded") == 0) {
+            core = CORE_THREADED;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jit") == 0) {
+            core = CORE_JIT;
+        } else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--flush-ms") == 0) && i + 1 < argc) {
+            flush_ms = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pool") == 0) && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) threads = 1;
+        } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--obj") == 0) && i + 1 < argc) {
+            objs[nobjs++] = argv[++i];
+        } else if ((strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "--profile") == 0) && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if ((strcmp(argv[i], "-I") == 0 || strcmp(argv[i], "--input") == 0) && i + 1 < argc) {
+            input_file = argv[++i];
+        } else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--record") == 0) && i + 1 < argc) {
+            record_file = argv[++i];
+        } else if ((strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--replay") == 0) && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if ((strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--gdb") == 0) && i + 1 < argc) {
+            gdb_target = argv[++i];
+        } else if (strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--supervisor") == 0) {
+            supervisor = true;
+        } else if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--image-cache") == 0) && i + 1 < argc) {
+            ld_cache_dir(argv[++i]);
+        } else {
+            images[nimages++] = argv[i];
         }
     }
     
-    if (image_file == NULL) {
+    if ((nimages == 0 && (nobjs == 0 || threads > 0)) || (nimages > 1 && threads == 0)) {
         fprintf(stderr, "Usage: %s [options] <image-file>\n", argv[0]);
+        fprintf(stderr, "       %s [options] -p <threads> <image-file>...\n", argv[0]);
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "  -d, --debug         Enable debug mode\n");
-        fprintf(stderr, "  -m, --memory-trace  Enable memory access tracing\n");
+        fprintf(stderr, "  -g, --gdb <port|path>  Wait for GDB on a localhost TCP port or a\n");
+        fprintf(stderr, "                      Unix socket and run under its control\n");
+        fprintf(stderr, "  -m, --memory-trace <file>  Write a binary memory access trace to\n");
+        fprintf(stderr, "                      <file>, read it with lc3-trace\n");
+        fprintf(stderr, "  -c, --cached        Run from the pre-decoded instruction cache\n");
+        fprintf(stderr, "  -t, --threaded      Run the threaded (computed goto) core\n");
+        fprintf(stderr, "  -j, --jit           Compile hot basic blocks to x86-64\n");
+        fprintf(stderr, "  -f, --flush-ms <ms> Flush buffered output every <ms> (0: only on\n");
+        fprintf(stderr, "                      halt, input and a full buffer, default %d)\n", OUT_FLUSH_MS);
+        fprintf(stderr, "  -p, --pool <n>      Run every image on <n> threads, console I/O\n");
+        fprintf(stderr, "                      from <image>.in and to <image>.out\n");
+        fprintf(stderr, "  -o, --obj <file>    Also load an object file at its origin (may be\n");
+        fprintf(stderr, "                      repeated, the first one is the entry without an image)\n");
+        fprintf(stderr, "                      Image and object files ending in .asm are assembled\n");
+        fprintf(stderr, "  -i, --image-cache <dir>  Keep byte-swapped images in <dir>\n");
+        fprintf(stderr, "  -b, --batch         Headless: no terminal setup or memory dumps, write a\n");
+        fprintf(stderr, "                      binary result record with the output to stdout\n");
+        fprintf(stderr, "  -I, --input <file>  Read keyboard input from <file> instead of stdin\n");
+        fprintf(stderr, "  -r, --record <file> Log every keyboard input with its instruction count\n");
+        fprintf(stderr, "  -R, --replay <file> Take keyboard input from a -r log, not the terminal\n");
+        fprintf(stderr, "  -S, --supervisor    Start in supervisor mode (system space writable,\n");
+        fprintf(stderr, "                      RTI drops to user mode)\n");
+        fprintf(stderr, "  -P, --profile <file> Count executions per address and opcode, write\n");
+        fprintf(stderr, "                      hot spots to <file> and stacks to <file>.folded\n");
         return 1;
     }
+
+    if (threads > 0) {
+        int rc = run_pool(images, nimages, threads, core);
+        free(images);
+        free(objs);
+        return rc;
+    }
+
+    char *image_file = images[0];
+    free(images);
+
+    struct lc3_vm *vm = vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    vm->debug_mode = debug_flag;
+    if (trace_file && (vm->trace = trace_open(trace_file)) != NULL) {
+        vm->memory_trace = true;
+    }
+    vm->core = core;
+    if (supervisor) {
+        vm->sys.psr = 0;
+    }
+
+    int in_fd = STDIN_FILENO;
+    if (input_file && (in_fd = open(input_file, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open file %s.\n", input_file);
+        return 1;
+    }
+    if (replay_file) {
+        if ((vm->replay = replay_open(replay_file)) == NULL) {
+            return 1;
+        }
+        in_fd = -1;                    // Every input comes from the log
+    } else if (record_file) {
+        if ((vm->replay = replay_record(record_file)) == NULL) {
+            return 1;
+        }
+        vm->counting = true;
+    }
+
+    if (batch) {
+        bool loaded = load(vm, image_file, objs, nobjs, false);
+        free(objs);
+        return run_batch(vm, loaded, in_fd);
+    }
     
-    debug_mode = debug_flag;
-    memory_trace = memory_trace_flag;
-    
-    // Set up terminal and signal handlers
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    // Set up terminal and signal handlers; a replay never reads the terminal
+    bool tty = in_fd == STDIN_FILENO;
+    if (tty) {
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+    }
     
     // Load and run program
-    ld_img(image_file, 0x0);
+    bool loaded = load(vm, image_file, objs, nobjs, true);
+    free(objs);
+    if (!loaded) {
+        if (tty) {
+            restore_input_buffering();
+        }
+        exit(1);
+    }
+
+    if (profile_file && (vm->prof = prof_create(vm->pc_start)) == NULL) {
+        fprintf(stderr, "Cannot allocate the profiler\n");
+    }
     
     fprintf(stdout, "Occupied memory after program load:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);
+    fprintf_mem_pages(stdout, vm->mem, vm->dirty, UINT16_MAX);
+    // From here on the bitmap only marks what the program itself writes
+    uint16_t *image_copy = mem_copy_pages(vm->mem, vm->dirty);
+    memset(vm->dirty, 0, sizeof(vm->dirty));
     
-    start(0x0); // START PROGRAM
+    // Program output is buffered, keep it behind what stdio already holds
+    fflush(stdout);
+    out_init(&vm->io, STDOUT_FILENO, flush_ms);
+    kbd_init(&vm->io, in_fd, tty);
+    if (gdb_target) {
+        vm->reg[RPC] = vm->pc_start;
+        if (gdb_serve(vm, gdb_target) > 0) {
+            vm_run(vm);                // Detached: run on from the current PC
+        }
+    } else {
+        start(vm, 0x0); // START PROGRAM
+    }
+    out_close(&vm->io);
     
-    fprintf(stdout, "Occupied memory after program execution:\n");
-    fprintf_mem_nonzero(stdout, mem, UINT16_MAX);
+    if (image_copy) {
+        fprintf(stdout, "Memory changed by program execution:\n");
+        fprintf_mem_diff(stdout, vm->mem, image_copy, vm->dirty, UINT16_MAX);
+        free(image_copy);
+    } else {
+        fprintf(stdout, "Occupied memory after program execution:\n");
+        fprintf_mem_nonzero(stdout, vm->mem, UINT16_MAX);
+    }
     
     fprintf(stdout, "Registers after program execution:\n");
-    fprintf_reg_all(stdout, reg, RCNT);
+    fprintf_reg_all(stdout, vm->reg, RCNT);
+
+    if (vm->prof) {
+        write_profile(vm, profile_file);
+    }
     
     // Restore terminal settings
-    restore_input_buffering();
-    
+    if (tty) {
+        restore_input_buffering();
+    }
+
+    vm_destroy(vm);
     return 0;
-}
\ No newline at end of file
+}
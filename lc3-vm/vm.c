@@ -0,0 +1,864 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "vm_asm.h"
+#include "vm_jit.h"
+#include "vm_dbg.h"
+#include "vm_debugger.h"
+#include "vm_prof.h"
+#include "vm_replay.h"
+#include "vm_trace.h"
+
+// Function type definitions
+typedef void (*op_ex_f)(struct lc3_vm *vm, uint16_t i);
+typedef void (*trp_ex_f)(struct lc3_vm *vm);
+
+// Pre-decoded instruction, one per memory word
+typedef struct dinst dinst;
+typedef void (*dop_ex_f)(struct lc3_vm *vm, const dinst *d);
+struct dinst {
+    dop_ex_f fn;                       // Specialised handler (d_decode when stale)
+    uint16_t raw;                      // Original instruction word (BR offset when fused)
+    uint16_t imm;                      // Sign-extended imm5/offset6/9/11
+    uint8_t dr, sr1, sr2;              // Register indices (dr holds nzp for BR)
+    uint8_t nzp;                       // Condition of a fused ADD+BR
+};
+
+static void d_decode(struct lc3_vm *vm, const dinst *d);
+
+// Stop the running core and have vm_run() choose again (mode changes,
+// exceptions). Every core checks running after stores and system ops.
+static void vm_resched(struct lc3_vm *vm) {
+    vm->resched = true;
+    vm->running = false;
+}
+
+// Store that every core sees: dirty page, caches and compiled code
+static inline void store(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    vm->mem[address] = val;
+    vm_touch(vm, address);
+    // Data pages were never decoded, only code pays for the invalidation
+    if (vm->dcache && page_dirty(vm->dcode, address / PAGE_WORDS)) {
+        vm->dcache[address].fn = d_decode;   // Invalidate pre-decoded entry
+        vm->dcache[(uint16_t)(address - 1)].fn = d_decode;   // and a pair ending here
+    }
+    if (vm->jit_map && vm->jit_map[address]) {
+        jit_invalidate(vm->jit, address);
+    }
+}
+
+static inline bool timer_on(const struct lc3_vm *vm) {
+    return (vm->mem[TMR] & (1 << 14)) && vm->mem[TMI] != 0;
+}
+
+// A store to TMR/TMI: restart the period when the timer starts or TMI
+// changes, and switch loops when the machine gains or loses its last device
+static void timer_sync(struct lc3_vm *vm, uint16_t address) {
+    bool on = timer_on(vm);
+    if (on && (!vm->sys.irq_armed || address == TMI)) {
+        vm->sys.timer_at = vm->sys.icount + vm->mem[TMI];
+    }
+    vm->sys.next_event = vm->sys.icount;
+    if ((on || vm->sys.irq_pending) != vm->sys.irq_armed) {
+        vm->sys.irq_armed = !vm->sys.irq_armed;
+        vm_resched(vm);
+    }
+}
+
+// Plain RAM store: traced, then seen by every core
+static inline void ram_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    if (vm->memory_trace) {
+        trace_put(vm->trace, TRACE_WRITE, address, vm->mem[address], val);
+    }
+    store(vm, address, val);
+}
+
+static void mr_io(struct lc3_vm *vm, uint16_t address) {
+    if (vm->io_map[address - IO_START].read) {
+        vm->io_map[address - IO_START].read(vm, address);
+    }
+}
+
+// Device registers are rare, keep RAM on the fall-through path
+static inline bool is_io(const struct lc3_vm *vm, uint16_t address) {
+    return __builtin_expect(address >= IO_START, 0) && (vm->page_attr[address / PAGE_WORDS] & PAGE_IO);
+}
+
+// Memory access functions with safety checks. A load below the device
+// range costs one predictable branch, a store one page attribute lookup;
+// protection and devices are handled out of line.
+static inline uint16_t mr(struct lc3_vm *vm, uint16_t address) {
+    if (is_io(vm, address)) {
+        mr_io(vm, address);
+    }
+
+    if (vm->memory_trace) {
+        trace_put(vm->trace, TRACE_READ, address, vm->mem[address], vm->mem[address]);
+    }
+
+    return vm->mem[address];
+}
+
+static void mw_slow(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    uint8_t attr = vm->page_attr[address / PAGE_WORDS];
+    if ((attr & PAGE_SYS) && (vm->sys.psr & PSR_USER)) {
+        // A kernel that installed an ACV handler gets the exception
+        if (vm->mem[IVT + EXC_ACV]) {
+            vm->sys.exc = EXC_ACV;
+            vm_resched(vm);
+            return;
+        }
+        fprintf(stderr, "Memory protection error: Cannot write to protected address 0x%04X\n", address);
+        return;
+    }
+    if (attr & (PAGE_COW | PAGE_WATCH)) {
+        debugger_store(vm->dbg, address, val);
+    }
+    if ((attr & PAGE_IO) && address >= IO_START && vm->io_map[address - IO_START].write) {
+        vm->io_map[address - IO_START].write(vm, address, val);
+        return;
+    }
+    ram_write(vm, address, val);
+}
+
+static inline void mw(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    if (__builtin_expect(vm->page_attr[address / PAGE_WORDS], 0)) {
+        mw_slow(vm, address, val);
+        return;
+    }
+    ram_write(vm, address, val);
+}
+
+// Supervisor stack push, unchecked but seen by the debugger
+static void push(struct lc3_vm *vm, uint16_t val) {
+    uint16_t address = --vm->reg[R6];
+    if (vm->page_attr[address / PAGE_WORDS] & (PAGE_COW | PAGE_WATCH)) {
+        debugger_store(vm->dbg, address, val);
+    }
+    store(vm, address, val);
+}
+
+// Enter a service routine: switch to the supervisor stack, push PSR and PC,
+// raise the priority and jump through the vector table
+static void interrupt(struct lc3_vm *vm, uint16_t vec, int pl) {
+    uint16_t psr = vm->sys.psr | vm->reg[RCND];
+    if (vm->sys.psr & PSR_USER) {
+        vm->sys.saved_usp = vm->reg[R6];
+        vm->reg[R6] = vm->sys.saved_ssp;
+    }
+    push(vm, psr);
+    push(vm, vm->reg[RPC]);
+    vm->sys.psr = pl << 8;
+    vm->reg[RCND] = 0;
+    vm->reg[RPC] = vm->mem[IVT + vec];
+}
+
+// Called from the counting loop once icount reaches next_event
+static void irq_service(struct lc3_vm *vm) {
+    struct lc3_sys *sys = &vm->sys;
+    bool on = timer_on(vm);
+    if (on && sys->icount >= sys->timer_at) {
+        vm->mem[TMR] |= 1 << 15;
+        vm_touch(vm, TMR);
+        sys->timer_at += vm->mem[TMI];
+        sys->irq_pending = 1;
+    }
+    if (sys->irq_pending && TIMER_PL > PSR_PL(sys->psr)) {
+        sys->irq_pending = 0;
+        interrupt(vm, TIMER_VEC, TIMER_PL);
+    }
+
+    // A masked interrupt is looked at again when RTI lowers the priority
+    sys->next_event = on ? sys->timer_at : UINT64_MAX;
+    if (!on && !sys->irq_pending) {
+        sys->irq_armed = false;
+        vm_resched(vm);
+    }
+}
+
+// Update flags based on register value
+static inline void uf(struct lc3_vm *vm, enum regist r) {
+    if (vm->reg[r]==0) vm->reg[RCND] = FZ;
+    else if (vm->reg[r]>>15) vm->reg[RCND] = FN;
+    else vm->reg[RCND] = FP;
+}
+
+#define reg (vm->reg)
+
+// Instruction implementations
+static inline void add(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)] = reg[SR1(i)] + (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(vm, DR(i)); }
+static inline void and(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)] = reg[SR1(i)] & (FIMM(i) ? SEXTIMM(i) : reg[SR2(i)]); uf(vm, DR(i)); }
+static inline void ldi(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)] = mr(vm, mr(vm, reg[RPC]+POFF9(i))); uf(vm, DR(i)); }
+static inline void not(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)]=~reg[SR1(i)]; uf(vm, DR(i)); }
+static inline void br(struct lc3_vm *vm, uint16_t i)   { if (reg[RCND] & FCND(i)) { reg[RPC] += POFF9(i); } }
+static inline void jsr(struct lc3_vm *vm, uint16_t i)  { reg[R7] = reg[RPC]; reg[RPC] = (FL(i)) ? reg[RPC] + POFF11(i) : reg[BR(i)]; }
+static inline void jmp(struct lc3_vm *vm, uint16_t i)  { reg[RPC] = reg[BR(i)]; }
+static inline void ld(struct lc3_vm *vm, uint16_t i)   { reg[DR(i)] = mr(vm, reg[RPC] + POFF9(i)); uf(vm, DR(i)); }
+static inline void ldr(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)] = mr(vm, reg[SR1(i)] + POFF(i)); uf(vm, DR(i)); }
+static inline void lea(struct lc3_vm *vm, uint16_t i)  { reg[DR(i)] = reg[RPC] + POFF9(i); uf(vm, DR(i)); }
+static inline void st(struct lc3_vm *vm, uint16_t i)   { mw(vm, reg[RPC] + POFF9(i), reg[DR(i)]); }
+static inline void sti(struct lc3_vm *vm, uint16_t i)  { mw(vm, mr(vm, reg[RPC] + POFF9(i)), reg[DR(i)]); }
+static inline void str(struct lc3_vm *vm, uint16_t i)  { mw(vm, reg[SR1(i)] + POFF(i), reg[DR(i)]); }
+
+static inline void rti(struct lc3_vm *vm, uint16_t i) {
+    if (vm->sys.psr & PSR_USER) {
+        if (vm->mem[IVT + EXC_PRIV]) {
+            vm->sys.exc = EXC_PRIV;
+            vm_resched(vm);
+        } else {
+            fprintf(stderr, "RTI in user mode\n");
+        }
+        return;
+    }
+    reg[RPC] = mr(vm, reg[R6]++);
+    uint16_t psr = mr(vm, reg[R6]++);
+    vm->sys.psr = psr & (PSR_USER | 0x0700);
+    reg[RCND] = psr & 0x7;
+    if (psr & PSR_USER) {
+        vm->sys.saved_ssp = reg[R6];
+        reg[R6] = vm->sys.saved_usp;
+    }
+    vm->sys.next_event = vm->sys.icount;       // Priority may have dropped below a pending one
+}
+
+static inline void res(struct lc3_vm *vm, uint16_t i) {
+    if (vm->mem[IVT + EXC_ILL]) {
+        vm->sys.exc = EXC_ILL;
+        vm_resched(vm);
+        return;
+    }
+    fprintf(stderr, "Reserved opcode used\n");
+}
+
+// Trap routines
+// Keyboard input in replay comes from the log. When the log runs out or
+// the run diverges the machine stops and every read gets EOF; a rewound
+// recording that caught up goes back to the keyboard.
+static bool in_replayed(struct lc3_vm *vm, enum replay_ev kind, int *value) {
+    if (vm->replay == NULL || !replay_playing(vm->replay)) {
+        return false;
+    }
+    if (!replay_get(vm->replay, kind, value)) {
+        if (!replay_playing(vm->replay)) {
+            return false;
+        }
+        vm->running = false;
+        *value = KBD_EOF;
+    }
+    return true;
+}
+
+static inline void in_recorded(struct lc3_vm *vm, enum replay_ev kind, int value) {
+    if (vm->replay) {
+        replay_put(vm->replay, vm->sys.icount, kind, value);
+    }
+}
+
+static int in_getc(struct lc3_vm *vm) {
+    int c;
+    if (!in_replayed(vm, EV_GETC, &c)) {
+        c = kbd_getc(&vm->io);
+        in_recorded(vm, EV_GETC, c);
+    }
+    return c;
+}
+
+static inline void tgetc(struct lc3_vm *vm) {
+    out_flush(&vm->io);
+    reg[R0] = in_getc(vm);
+}
+
+static inline void tout(struct lc3_vm *vm) {
+    out_putc(&vm->io, (char)reg[R0]);
+}
+
+static inline void tputs(struct lc3_vm *vm) {
+    uint16_t addr = reg[R0];
+    // Add bounds checking
+    if (addr >= UINT16_MAX) {
+        fprintf(stderr, "Error: Invalid memory address in PUTS trap\n");
+        return;
+    }
+
+    uint16_t *p = vm->mem + addr;
+    while(*p && p < vm->mem + UINT16_MAX) {
+        out_putc(&vm->io, (char)*p);
+        p++;
+    }
+}
+
+static inline void tin(struct lc3_vm *vm) {
+    out_flush(&vm->io);
+    reg[R0] = in_getc(vm);
+    out_putc(&vm->io, (char)reg[R0]);
+}
+
+static inline void tputsp(struct lc3_vm *vm) {
+    uint16_t addr = reg[R0];
+    if (addr >= UINT16_MAX) {
+        fprintf(stderr, "Error: Invalid memory address in PUTSP trap\n");
+        return;
+    }
+
+    uint16_t *p = vm->mem + addr;
+    while (*p && p < vm->mem + UINT16_MAX) {
+        char c1 = (*p) & 0xFF;
+        out_putc(&vm->io, c1);
+
+        char c2 = (*p) >> 8;
+        if (c2) out_putc(&vm->io, c2);
+
+        p++;
+    }
+}
+
+static inline void thalt(struct lc3_vm *vm) {
+    static const char msg[] = "\nHALT instruction executed\n";
+    vm->running = false;
+    out_write(&vm->io, msg, sizeof(msg) - 1);
+    out_flush(&vm->io);
+}
+
+static inline void tinu16(struct lc3_vm *vm) {
+    out_flush(&vm->io);
+    int v;
+    uint16_t n;
+    if (!in_replayed(vm, EV_U16, &v)) {
+        v = kbd_read_u16(&vm->io, &n) ? n : -1;
+        in_recorded(vm, EV_U16, v);
+    }
+    if (v >= 0) {
+        reg[R0] = v;                   // Untouched when no number followed
+    }
+}
+
+static inline void toutu16(struct lc3_vm *vm) {
+    char buf[8];
+    int n = snprintf(buf, sizeof(buf), "%hu\n", reg[R0]);
+    out_write(&vm->io, buf, n);
+}
+
+// Trap execution table
+static const trp_ex_f trp_ex[8] = { tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16 };
+
+static inline void trap(struct lc3_vm *vm, uint16_t i) {
+    uint8_t trapcode = TRP(i)-trp_offset;
+    if (trapcode >= 8) {
+        fprintf(stderr, "Invalid trap code: 0x%02X\n", TRP(i));
+        return;
+    }
+    trp_ex[trapcode](vm);
+}
+
+// Operation execution table
+static const op_ex_f op_ex[NOPS] = { /*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi, sti, jmp, res, lea, trap };
+
+// Pre-decoded instruction implementations
+static void d_add_r(struct lc3_vm *vm, const dinst *d) { reg[d->dr] = reg[d->sr1] + reg[d->sr2]; uf(vm, d->dr); }
+static void d_add_i(struct lc3_vm *vm, const dinst *d) { reg[d->dr] = reg[d->sr1] + d->imm; uf(vm, d->dr); }
+static void d_and_r(struct lc3_vm *vm, const dinst *d) { reg[d->dr] = reg[d->sr1] & reg[d->sr2]; uf(vm, d->dr); }
+static void d_and_i(struct lc3_vm *vm, const dinst *d) { reg[d->dr] = reg[d->sr1] & d->imm; uf(vm, d->dr); }
+static void d_not(struct lc3_vm *vm, const dinst *d)   { reg[d->dr] = ~reg[d->sr1]; uf(vm, d->dr); }
+static void d_br(struct lc3_vm *vm, const dinst *d)    { if (reg[RCND] & d->dr) { reg[RPC] += d->imm; } }
+static void d_jsr(struct lc3_vm *vm, const dinst *d)   { reg[R7] = reg[RPC]; reg[RPC] += d->imm; }
+static void d_jsrr(struct lc3_vm *vm, const dinst *d)  { reg[R7] = reg[RPC]; reg[RPC] = reg[d->sr1]; }
+static void d_jmp(struct lc3_vm *vm, const dinst *d)   { reg[RPC] = reg[d->sr1]; }
+static void d_ld(struct lc3_vm *vm, const dinst *d)    { reg[d->dr] = mr(vm, reg[RPC] + d->imm); uf(vm, d->dr); }
+static void d_ldi(struct lc3_vm *vm, const dinst *d)   { reg[d->dr] = mr(vm, mr(vm, reg[RPC] + d->imm)); uf(vm, d->dr); }
+static void d_ldr(struct lc3_vm *vm, const dinst *d)   { reg[d->dr] = mr(vm, reg[d->sr1] + d->imm); uf(vm, d->dr); }
+static void d_lea(struct lc3_vm *vm, const dinst *d)   { reg[d->dr] = reg[RPC] + d->imm; uf(vm, d->dr); }
+static void d_st(struct lc3_vm *vm, const dinst *d)    { mw(vm, reg[RPC] + d->imm, reg[d->dr]); }
+static void d_sti(struct lc3_vm *vm, const dinst *d)   { mw(vm, mr(vm, reg[RPC] + d->imm), reg[d->dr]); }
+static void d_str(struct lc3_vm *vm, const dinst *d)   { mw(vm, reg[d->sr1] + d->imm, reg[d->dr]); }
+static void d_raw(struct lc3_vm *vm, const dinst *d)   { op_ex[OPC(d->raw)](vm, d->raw); }
+
+// Fused pairs (see fuse_kind()): both instructions in one dispatch, the
+// flags are those the second uf() leaves behind
+static void d_set(struct lc3_vm *vm, const dinst *d)      { reg[d->dr] = d->imm; uf(vm, d->dr); reg[RPC]++; }
+static void d_neg(struct lc3_vm *vm, const dinst *d)      { reg[d->dr] = -reg[d->sr1]; uf(vm, d->dr); reg[RPC]++; }
+static void d_add_i_br(struct lc3_vm *vm, const dinst *d) {
+    reg[d->dr] = reg[d->sr1] + d->imm; uf(vm, d->dr);
+    reg[RPC]++; if (reg[RCND] & d->nzp) { reg[RPC] += d->raw; }
+}
+static void d_add_r_br(struct lc3_vm *vm, const dinst *d) {
+    reg[d->dr] = reg[d->sr1] + reg[d->sr2]; uf(vm, d->dr);
+    reg[RPC]++; if (reg[RCND] & d->nzp) { reg[RPC] += d->raw; }
+}
+
+#undef reg
+
+// Plain fetch and dispatch through op_ex. Kept out of vm_run() so where
+// this loop lands in the binary does not move with everything around it.
+static __attribute__((noinline)) void start_table(struct lc3_vm *vm) {
+    while(vm->running) {
+        uint16_t i = mr(vm, vm->reg[RPC]++);
+        op_ex[OPC(i)](vm, i);
+    }
+}
+
+// Instruction boundary check for loops running with a device armed; false
+// when servicing stopped the core
+static inline bool irq_poll(struct lc3_vm *vm) {
+    if (vm->sys.icount >= vm->sys.next_event) {
+        irq_service(vm);
+        return vm->running;
+    }
+    return true;
+}
+
+// Table loop that counts instructions, used while a device is armed or
+// while recording input (the log stamps events with the count)
+static void start_counted(struct lc3_vm *vm) {
+    while(vm->running) {
+        if (!irq_poll(vm)) break;
+        uint16_t i = mr(vm, vm->reg[RPC]++);
+        op_ex[OPC(i)](vm, i);
+        vm->sys.icount++;
+    }
+}
+
+// Note that the page of a holds decoded entries
+static inline void mark_code(struct lc3_vm *vm, uint16_t a) {
+    vm->dcode[a >> 12] |= 1ULL << ((a >> 6) & 63);
+}
+
+// Fill a cache slot from the word in memory, then execute it
+static void d_decode(struct lc3_vm *vm, const dinst *d) {
+    uint16_t addr = d - vm->dcache;
+    uint16_t i = mr(vm, addr);
+    dinst *e = &vm->dcache[addr];
+
+    // Never cache memory-mapped I/O, the fetch itself has side effects
+    if (is_io(vm, addr)) {
+        op_ex[OPC(i)](vm, i);
+        return;
+    }
+
+    e->raw = i;
+    e->dr = DR(i);
+    e->sr1 = SR1(i);
+    e->sr2 = SR2(i);
+    e->imm = 0;
+    switch (OPC(i)) {
+        case 0x0: e->fn = d_br; e->imm = POFF9(i); break;
+        case 0x1: e->fn = FIMM(i) ? d_add_i : d_add_r; e->imm = SEXTIMM(i); break;
+        case 0x2: e->fn = d_ld; e->imm = POFF9(i); break;
+        case 0x3: e->fn = d_st; e->imm = POFF9(i); break;
+        case 0x4: e->fn = FL(i) ? d_jsr : d_jsrr; e->imm = POFF11(i); break;
+        case 0x5: e->fn = FIMM(i) ? d_and_i : d_and_r; e->imm = SEXTIMM(i); break;
+        case 0x6: e->fn = d_ldr; e->imm = POFF(i); break;
+        case 0x7: e->fn = d_str; e->imm = POFF(i); break;
+        case 0x9: e->fn = d_not; break;
+        case 0xA: e->fn = d_ldi; e->imm = POFF9(i); break;
+        case 0xB: e->fn = d_sti; e->imm = POFF9(i); break;
+        case 0xC: e->fn = d_jmp; break;
+        case 0xE: e->fn = d_lea; e->imm = POFF9(i); break;
+        default:  e->fn = d_raw; break;   // RTI, RES, TRAP
+    }
+
+    // Fuse with the next word; its own slot stays valid for jumps into it
+    uint16_t next = vm->mem[(uint16_t)(addr + 1)];
+    enum fuse kind = addr + 1 < IO_START ? fuse_kind(i, next) : FUSE_NONE;
+    switch (kind) {
+        case FUSE_SET: e->fn = d_set; e->imm = SEXTIMM(next); break;
+        case FUSE_NEG: e->fn = d_neg; break;
+        case FUSE_ADD_BR:
+            e->fn = FIMM(i) ? d_add_i_br : d_add_r_br;
+            e->nzp = FCND(next);
+            e->raw = POFF9(next);
+            break;
+        default: break;
+    }
+    // A pair also belongs to the page of its second word, so a store there
+    // finds it
+    mark_code(vm, addr);
+    if (kind != FUSE_NONE) {
+        mark_code(vm, addr + 1);
+    }
+    e->fn(vm, e);
+}
+
+// Mark the cache slots stale (memory was written behind mw()'s back). Only
+// pages in dcode hold anything but d_decode.
+static void dcache_reset(struct lc3_vm *vm) {
+    for (int p = 0; p < NPAGES; p++) {
+        if (page_dirty(vm->dcode, p)) {
+            for (int a = p * PAGE_WORDS; a < (p + 1) * PAGE_WORDS; a++) {
+                vm->dcache[a].fn = d_decode;
+            }
+        }
+    }
+    memset(vm->dcode, 0, sizeof(vm->dcode));
+}
+
+// Pre-decoded execution loop, same results as the op_ex table path
+static void start_cached(struct lc3_vm *vm) {
+    dinst *dcache = vm->dcache;
+    dcache_reset(vm);
+    while(vm->running) {
+        uint16_t pc = vm->reg[RPC]++;
+        dcache[pc].fn(vm, &dcache[pc]);
+    }
+}
+
+#if defined(__GNUC__)
+// Threaded execution loop using labels-as-values: every handler ends in its
+// own indirect jump, and the register file lives in locals until a trap
+// or exit needs reg[] to be current.
+static void start_threaded(struct lc3_vm *vm) {
+    static void *disp[NOPS] = {
+        &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_sys, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_sys, &&op_lea, &&op_sys
+    };
+    uint16_t r[R7+1];
+    uint16_t pc, cnd, i;
+    bool io = false;                   // Last T_MR() went to a device
+
+    #define T_LOAD()  do { memcpy(r, vm->reg, sizeof(r)); pc = vm->reg[RPC]; cnd = vm->reg[RCND]; } while (0)
+    #define T_STORE() do { memcpy(vm->reg, r, sizeof(r)); vm->reg[RPC] = pc; vm->reg[RCND] = cnd; } while (0)
+    #define T_UF(v)   do { uint16_t _v = (v); cnd = _v == 0 ? FZ : (_v >> 15) ? FN : FP; } while (0)
+    #define T_NEXT()  do { i = mr(vm, pc++); goto *disp[OPC(i)]; } while (0)
+    // Data loads from I/O space may read the PSR, which includes cnd, and
+    // may stop the machine (a replay log running out); T_IO() checks that
+    #define T_MR(a)   ({ uint16_t _a = (a); (io = is_io(vm, _a)) ? (vm->reg[RCND] = cnd, mr(vm, _a)) : mr(vm, _a); })
+    #define T_IO()    do { if (__builtin_expect(io, 0) && !vm->running) goto out; } while (0)
+
+    T_LOAD();
+    if (!vm->running) goto out;
+    T_NEXT();
+
+op_br:  if (cnd & FCND(i)) { pc += POFF9(i); } T_NEXT();
+op_add: r[DR(i)] = r[SR1(i)] + (FIMM(i) ? SEXTIMM(i) : r[SR2(i)]); T_UF(r[DR(i)]); T_NEXT();
+op_and: r[DR(i)] = r[SR1(i)] & (FIMM(i) ? SEXTIMM(i) : r[SR2(i)]); T_UF(r[DR(i)]); T_NEXT();
+op_not: r[DR(i)] = ~r[SR1(i)]; T_UF(r[DR(i)]); T_NEXT();
+op_jsr: r[R7] = pc; pc = FL(i) ? pc + POFF11(i) : r[BR(i)]; T_NEXT();
+op_jmp: pc = r[BR(i)]; T_NEXT();
+op_ld:  r[DR(i)] = T_MR(pc + POFF9(i)); T_UF(r[DR(i)]); T_IO(); T_NEXT();
+op_ldi: r[DR(i)] = T_MR(mr(vm, pc + POFF9(i))); T_UF(r[DR(i)]); T_IO(); T_NEXT();
+op_ldr: r[DR(i)] = T_MR(r[SR1(i)] + POFF(i)); T_UF(r[DR(i)]); T_IO(); T_NEXT();
+op_lea: r[DR(i)] = pc + POFF9(i); T_UF(r[DR(i)]); T_NEXT();
+// Stores may hit MCR and device loads may stop a replay, so loads check
+// running after an I/O access, stores and traps after every one
+op_st:  mw(vm, pc + POFF9(i), r[DR(i)]); if (!vm->running) goto out; T_NEXT();
+op_sti: mw(vm, mr(vm, pc + POFF9(i)), r[DR(i)]); if (!vm->running) goto out; T_NEXT();
+op_str: mw(vm, r[SR1(i)] + POFF(i), r[DR(i)]); if (!vm->running) goto out; T_NEXT();
+op_sys: T_STORE(); op_ex[OPC(i)](vm, i); T_LOAD(); if (!vm->running) goto out; T_NEXT();
+
+out:
+    T_STORE();
+
+    #undef T_LOAD
+    #undef T_STORE
+    #undef T_UF
+    #undef T_NEXT
+    #undef T_MR
+    #undef T_IO
+}
+#endif
+
+// JIT dispatch loop: run compiled blocks where they exist, interpret the rest
+static void start_jit(struct lc3_vm *vm) {
+    struct lc3_jit *jit = vm->jit;
+
+    jit_mark_leader(jit, vm->reg[RPC]);
+    while(vm->running) {
+        void *code = jit_block_for(jit, vm->reg[RPC]);
+        if (code && jit_enter(jit, code, vm->reg) == JIT_EXIT_CHAIN) {
+            jit_mark_leader(jit, vm->reg[RPC]);
+            continue;
+        }
+
+        // Side exits and cold code take one step through the table
+        uint16_t pc = vm->reg[RPC];
+        uint16_t i = mr(vm, vm->reg[RPC]++);
+        op_ex[OPC(i)](vm, i);
+        if (vm->reg[RPC] != (uint16_t)(pc + 1)) {
+            jit_mark_leader(jit, vm->reg[RPC]);
+        }
+    }
+}
+
+// Table loop with counting hooks, used only while vm->prof is set
+static void start_profile(struct lc3_vm *vm) {
+    struct lc3_prof *p = vm->prof;
+    while(vm->running) {
+        bool counted = vm->sys.irq_armed || vm->counting;
+        if (counted && !irq_poll(vm)) break;
+        uint16_t pc = vm->reg[RPC];
+        if (vm->memory_trace) {
+            trace_at(vm->trace, pc, vm->mem[pc]);
+        }
+        uint16_t i = mr(vm, vm->reg[RPC]++);
+        prof_count(p, pc, i);
+        op_ex[OPC(i)](vm, i);
+
+        // Call stacks follow JSR/JSRR and RET (JMP R7)
+        if (OPC(i) == 0x4) {
+            prof_call(p, vm->reg[RPC]);
+        } else if (OPC(i) == 0xC && BR(i) == R7) {
+            prof_ret(p);
+        }
+        vm->sys.icount += counted;
+    }
+}
+
+// Table loop that tells the trace which instruction each access belongs to
+static void start_trace(struct lc3_vm *vm) {
+    struct lc3_trace *t = vm->trace;
+    while(vm->running) {
+        bool counted = vm->sys.irq_armed || vm->counting;
+        if (counted && !irq_poll(vm)) break;
+        uint16_t pc = vm->reg[RPC];
+        trace_at(t, pc, vm->mem[pc]);
+        uint16_t i = mr(vm, vm->reg[RPC]++);
+        op_ex[OPC(i)](vm, i);
+        vm->sys.icount += counted;
+    }
+}
+
+// Main VM execution loop
+void start(struct lc3_vm *vm, uint16_t offset) {
+    vm->reg[RPC] = vm->pc_start + offset;
+    vm_run(vm);
+}
+
+// Pick the loop for the current options and machine state and run it
+static void run_core(struct lc3_vm *vm) {
+    if (vm->prof) {
+        start_profile(vm);
+        return;
+    }
+    if (vm->memory_trace) {
+        start_trace(vm);
+        return;
+    }
+
+    // An armed device needs the instruction count
+    if (vm->sys.irq_armed || vm->counting) {
+        start_counted(vm);
+        return;
+    }
+    if (vm->core == CORE_CACHED) {
+        if (vm->dcache == NULL && (vm->dcache = malloc((UINT16_MAX+1) * sizeof(dinst)))) {
+            for (uint32_t a = 0; a <= UINT16_MAX; a++) {
+                vm->dcache[a].fn = d_decode;
+            }
+            memset(vm->dcode, 0, sizeof(vm->dcode));
+        }
+        if (vm->dcache) {
+            start_cached(vm);
+            return;
+        }
+    }
+    if (vm->core == CORE_JIT) {
+        if (vm->jit || (vm->jit = jit_create(vm->mem, vm->dirty))) {
+            vm->jit_map = jit_code_map(vm->jit);
+            start_jit(vm);
+            return;
+        }
+    }
+#if defined(__GNUC__)
+    if (vm->core == CORE_THREADED) {
+        start_threaded(vm);
+        return;
+    }
+#endif
+
+    start_table(vm);
+}
+
+// One instruction for the debugger on the table path. Interrupts and
+// exceptions are taken where vm_run() would take them, and every
+// instruction is counted.
+void vm_step(struct lc3_vm *vm) {
+    if (!irq_poll(vm) && vm->resched) {
+        vm->resched = false;
+        vm->running = true;
+    }
+    uint16_t pc = vm->reg[RPC];
+    if (vm->memory_trace) {
+        trace_at(vm->trace, pc, vm->mem[pc]);
+    }
+    uint16_t i = mr(vm, vm->reg[RPC]++);
+    op_ex[OPC(i)](vm, i);
+    vm->sys.icount++;
+    if (vm->resched) {
+        vm->resched = false;
+        vm->running = true;
+        if (vm->sys.exc >= 0) {
+            interrupt(vm, vm->sys.exc, PSR_PL(vm->sys.psr));
+            vm->sys.exc = -1;
+        }
+    }
+}
+
+// Run from the current PC until the machine stops. Cores return early with
+// resched set when an exception is due or a device is armed or disarmed.
+void vm_run(struct lc3_vm *vm) {
+    if (vm->memory_trace && vm->trace == NULL && (vm->trace = trace_open(TRACE_FILE)) == NULL) {
+        vm->memory_trace = false;
+    }
+    // Debug mode: the debugger steps the machine itself
+    if (vm->debug_mode) {
+        if (vm->dbg || debugger_create(vm)) {
+            debugger_main(vm->dbg);
+        } else {
+            fprintf(stderr, "Cannot allocate the debugger\n");
+        }
+        return;
+    }
+    do {
+        vm->resched = false;
+        if (vm->sys.exc >= 0) {
+            interrupt(vm, vm->sys.exc, PSR_PL(vm->sys.psr));
+            vm->sys.exc = -1;
+        }
+        run_core(vm);
+    } while (vm->resched && (vm->running = true));
+}
+
+// Built-in devices
+static void kbsr_read(struct lc3_vm *vm, uint16_t address) {
+    out_flush(&vm->io);                // Show prompts before polling for input
+    int c;
+    if (!in_replayed(vm, EV_POLL, &c)) {
+        c = kbd_poll(&vm->io);         // Queue only, never a syscall
+        in_recorded(vm, EV_POLL, c);
+    }
+    vm_touch(vm, KBSR);
+    if (c != KBD_NONE) {
+        vm->mem[KBSR] = (1 << 15);
+        vm->mem[KBDR] = c;
+    } else {
+        vm->mem[KBSR] = 0;
+    }
+}
+
+static void ddr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    out_putc(&vm->io, (char)val);
+}
+
+static void timer_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    ram_write(vm, address, val);
+    timer_sync(vm, address);
+}
+
+static void psr_read(struct lc3_vm *vm, uint16_t address) {
+    vm->mem[PSR] = vm->sys.psr | vm->reg[RCND];
+    vm_touch(vm, PSR);
+}
+
+static void mcr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+    if ((val & (1 << 15)) == 0) {
+        vm->running = false;
+    }
+}
+
+// Attach handlers to a device register and mark its page; -1 outside
+// the device range, which the JIT assumes is the only place for them
+int vm_map_io(struct lc3_vm *vm, uint16_t address, io_read_f read, io_write_f write) {
+    if (address < IO_START) {
+        return -1;
+    }
+    vm->io_map[address - IO_START].read = read;
+    vm->io_map[address - IO_START].write = write;
+    vm->page_attr[address / PAGE_WORDS] |= PAGE_IO;
+    return 0;
+}
+
+// User mode at priority 0, which keeps the system space write protected
+static void vm_sys_reset(struct lc3_vm *vm) {
+    memset(&vm->sys, 0, sizeof(vm->sys));
+    vm->sys.psr = PSR_USER;
+    vm->sys.saved_ssp = SSP_START;
+    vm->sys.exc = -1;
+    vm->sys.next_event = UINT64_MAX;
+    vm->resched = false;
+}
+
+struct lc3_vm *vm_create() {
+    struct lc3_vm *vm = malloc(sizeof(*vm));
+    if (vm == NULL) {
+        return NULL;
+    }
+    // Memory gets a mapping of its own so a reset or a snapshot restore can
+    // swap pages underneath instead of copying the whole address space
+    vm->mem = mmap(NULL, MEM_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm->mem == MAP_FAILED) {
+        free(vm);
+        return NULL;
+    }
+    io_init(&vm->io);
+    vm->dcache = NULL;
+    vm->jit = NULL;
+    vm->jit_map = NULL;
+    vm->prof = NULL;
+    vm->trace = NULL;
+    vm->replay = NULL;
+    vm->counting = false;
+    vm->dbg = NULL;
+    vm->syms = NULL;
+    vm->debug_mode = DEBUG_MODE;
+    vm->memory_trace = MEMORY_TRACE;
+    vm->core = CORE_TABLE;
+    memset(vm->reg, 0, sizeof(vm->reg));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->pc_start = PC_START;
+    vm_sys_reset(vm);
+    vm->running = true;
+
+    memset(vm->page_attr, 0, sizeof(vm->page_attr));
+    memset(vm->io_map, 0, sizeof(vm->io_map));
+    if (MEMORY_PROTECTION) {
+        for (int p = MEM_PROTECTED_START / PAGE_WORDS; p <= MEM_PROTECTED_END / PAGE_WORDS; p++) {
+            vm->page_attr[p] |= PAGE_SYS;
+        }
+    }
+    vm_map_io(vm, KBSR, kbsr_read, NULL);
+    vm_map_io(vm, DDR, NULL, ddr_write);
+    vm_map_io(vm, TMR, NULL, timer_write);
+    vm_map_io(vm, TMI, NULL, timer_write);
+    vm_map_io(vm, PSR, psr_read, NULL);
+    vm_map_io(vm, MCR, NULL, mcr_write);
+    return vm;
+}
+
+// Back to power-on state; options, core and console streams are kept.
+// Mapping fresh zero pages over memory only costs the pages that were used.
+void vm_reset(struct lc3_vm *vm) {
+    if (mmap(vm->mem, MEM_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        memset(vm->mem, 0, MEM_BYTES);
+    }
+    memset(vm->reg, 0, sizeof(vm->reg));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->pc_start = PC_START;
+    vm_sys_reset(vm);
+    vm->running = true;
+    sym_destroy(vm->syms);
+    vm->syms = NULL;
+    if (vm->jit) {
+        jit_reset(vm->jit);
+    }
+}
+
+void vm_destroy(struct lc3_vm *vm) {
+    if (vm == NULL) {
+        return;
+    }
+    io_destroy(&vm->io);
+    jit_destroy(vm->jit);
+    prof_destroy(vm->prof);
+    trace_close(vm->trace);
+    debugger_destroy(vm->dbg);
+    sym_destroy(vm->syms);
+    replay_close(vm->replay);
+    free(vm->dcache);
+    munmap(vm->mem, MEM_BYTES);
+    free(vm);
+}
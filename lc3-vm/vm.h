@@ -0,0 +1,178 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm_io.h"
+
+// Configuration and Debug Options
+#define NOPS (16)                      // Number of operations
+#define DEBUG_MODE 0                   // Set to 1 to enable debug output
+#define MEMORY_TRACE 0                 // Set to 1 to trace memory accesses to TRACE_FILE
+#define MEMORY_PROTECTION 1            // Set to 1 to enable memory protection
+
+// Memory-mapped I/O addresses
+#define KBSR 0xFE00                    // Keyboard status register
+#define KBDR 0xFE02                    // Keyboard data register
+#define DSR 0xFE04                     // Display status register
+#define DDR 0xFE06                     // Display data register
+#define TMR 0xFE08                     // Timer status/control (15: fired, 14: enable)
+#define TMI 0xFE0A                     // Timer interval in instructions
+#define PSR 0xFFFC                     // Processor status register (read only)
+#define MCR 0xFFFE                     // Machine control register
+
+// Privileged architecture
+#define IVT 0x0100                     // Interrupt vector table
+#define PSR_USER (1 << 15)             // Privilege bit, set in user mode
+#define PSR_PL(psr) (((psr) >> 8) & 7) // Priority level
+#define SSP_START 0x3000               // Initial supervisor stack pointer
+#define EXC_PRIV 0x00                  // RTI in user mode
+#define EXC_ILL 0x01                   // Reserved opcode
+#define EXC_ACV 0x02                   // User access to system space
+#define TIMER_VEC 0x81
+#define TIMER_PL 4
+
+// Memory protection
+#define MEM_PROTECTED_START 0x0000
+#define MEM_PROTECTED_END   0x2FFF
+
+// Instruction parsing macros
+#define OPC(i) ((i)>>12)               // Extract operation code (bits 15-12)
+#define DR(i) (((i)>>9)&0x7)           // Extract destination register (bits 11-9)
+#define SR1(i) (((i)>>6)&0x7)          // Extract first source register (bits 8-6)
+#define SR2(i) ((i)&0x7)               // Extract second source register (bits 2-0)
+#define FIMM(i) ((i>>5)&01)            // Extract immediate mode flag (bit 5)
+#define IMM(i) ((i)&0x1F)              // Extract immediate value (bits 4-0)
+#define SEXTIMM(i) sext(IMM(i),5)      // Sign-extend immediate value
+#define FCND(i) (((i)>>9)&0x7)         // Extract condition flags (bits 11-9)
+#define POFF(i) sext((i)&0x3F, 6)      // Extract and sign-extend 6-bit offset
+#define POFF9(i) sext((i)&0x1FF, 9)    // Extract and sign-extend 9-bit offset
+#define POFF11(i) sext((i)&0x7FF, 11)  // Extract and sign-extend 11-bit offset
+#define FL(i) (((i)>>11)&1)            // Extract addressing mode flag (bit 11)
+#define BR(i) (((i)>>6)&0x7)           // Extract base register (bits 8-6)
+#define TRP(i) ((i)&0xFF)              // Extract trap vector (bits 7-0)
+
+// Constants and enumerations
+enum { trp_offset = 0x20 };            // Trap vector offset
+enum regist { R0 = 0, R1, R2, R3, R4, R5, R6, R7, RPC, RCND, RCNT };
+enum flags { FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
+
+// Sign extension function
+static inline uint16_t sext(uint16_t n, int b) { 
+    return ((n>>(b-1))&1) ? (n|(0xFFFF << b)) : n; 
+}
+
+// Instruction pairs the cached core runs as one handler: AND Rx,Ry,#0 +
+// ADD Rx,Rx,#imm (load immediate), NOT Rx,Ry + ADD Rx,Rx,#1 (negate), and
+// ADD + BR (count and branch). The second word is never in device space.
+enum fuse { FUSE_NONE = 0, FUSE_SET, FUSE_NEG, FUSE_ADD_BR, NFUSE };
+
+static inline enum fuse fuse_kind(uint16_t i, uint16_t next) {
+    bool add_dr_imm = OPC(next) == 0x1 && FIMM(next) && DR(next) == DR(i) && SR1(next) == DR(i);
+    if (OPC(i) == 0x5 && FIMM(i) && IMM(i) == 0 && add_dr_imm) return FUSE_SET;
+    if (OPC(i) == 0x9 && add_dr_imm && IMM(next) == 1) return FUSE_NEG;
+    if (OPC(i) == 0x1 && OPC(next) == 0x0) return FUSE_ADD_BR;
+    return FUSE_NONE;
+}
+
+#define PC_START 0x3000                // Default load and entry address
+#define MEM_WORDS (UINT16_MAX+1)       // Address space in words
+#define MEM_BYTES (MEM_WORDS * sizeof(uint16_t))
+#define PAGE_WORDS 64                  // Dirty tracking granularity
+#define NPAGES (MEM_WORDS / PAGE_WORDS)
+
+// Page attributes, one byte per page; ordinary RAM is 0
+#define PAGE_SYS (1 << 0)              // Writable in supervisor mode only
+#define PAGE_IO (1 << 1)               // Holds device registers, see vm_map_io()
+#define PAGE_COW (1 << 2)              // Debugger: copy the page before its next write
+#define PAGE_WATCH (1 << 3)            // Debugger: writes are checked against watchpoints
+#define IO_START 0xFE00                // Device registers live in IO_START..0xFFFF
+#define IO_WORDS (MEM_WORDS - IO_START)
+
+struct lc3_vm;
+
+// Device register handlers. A read handler brings mem[address] up to date
+// before the load sees it; a write handler takes the place of the store.
+typedef void (*io_read_f)(struct lc3_vm *vm, uint16_t address);
+typedef void (*io_write_f)(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+struct io_slot {
+    io_read_f read;                    // NULL: plain memory read
+    io_write_f write;                  // NULL: plain memory write
+};
+
+// Interpreter cores
+enum vm_core { CORE_TABLE = 0, CORE_CACHED, CORE_THREADED, CORE_JIT };
+
+struct dinst;
+struct lc3_jit;
+struct lc3_prof;
+struct lc3_trace;
+struct lc3_debugger;
+struct lc3_syms;
+
+// One LC-3 machine. Every handler, trap and loader works on one of these,
+// so any number of them can run side by side in a process.
+// Privileged and device state outside reg[]; NZP of the PSR lives in
+// reg[RCND]. Interrupts are only looked at while irq_armed: vm_run() then
+// uses a loop that counts instructions and services next_event.
+struct lc3_sys {
+    uint16_t psr;                      // Privilege and priority bits
+    uint16_t saved_ssp, saved_usp;     // Stack pointer of the mode not running
+    int exc;                           // Exception to take at the next boundary, -1 if none
+    bool irq_armed;
+    uint8_t irq_pending;               // Raised interrupts not yet taken
+    uint64_t icount;                   // Instructions counted while armed
+    uint64_t next_event;               // icount at which to look again
+    uint64_t timer_at;                 // icount of the next timer expiry
+};
+
+struct lc3_vm {
+    uint16_t *mem;                     // MEM_WORDS, its own mapping (see vm_snap.c)
+    uint64_t dirty[NPAGES / 64];       // Pages written since the last reset
+    uint16_t reg[RCNT];
+    uint16_t pc_start;
+    bool running;
+    bool debug_mode;
+    bool memory_trace;
+    enum vm_core core;
+
+    struct lc3_sys sys;
+    bool resched;                      // Core stopped so vm_run() can pick again
+
+    struct dinst *dcache;              // Pre-decoded instructions (cached core)
+    uint64_t dcode[NPAGES / 64];       // Pages the dcache holds decoded entries for
+    struct lc3_jit *jit;               // Compiled blocks (JIT core)
+    uint8_t *jit_map;                  // Addresses covered by compiled blocks
+    struct lc3_prof *prof;             // Execution counts, NULL when not profiling
+    struct lc3_trace *trace;           // Memory trace sink while memory_trace is set
+    struct lc3_replay *replay;         // Input log being recorded or replayed
+    bool counting;                     // Count every instruction, not only while armed
+    struct lc3_debugger *dbg;          // Checkpoints and breakpoints in debug mode
+    struct lc3_syms *syms;             // Labels of assembled sources, NULL if none
+    struct lc3_io io;                  // Console output ring and keyboard queue
+
+    // Large tables last, the hot fields above stay close together
+    uint8_t page_attr[NPAGES];         // PAGE_* bits
+    struct io_slot io_map[IO_WORDS];   // Handlers for device registers
+};
+
+// Note a write to address a in the dirty page bitmap
+static inline void vm_touch(struct lc3_vm *vm, uint16_t a) {
+    vm->dirty[a >> 12] |= 1ULL << ((a >> 6) & 63);
+}
+
+static inline bool page_dirty(const uint64_t *dirty, int page) {
+    return dirty[page >> 6] >> (page & 63) & 1;
+}
+
+struct lc3_vm *vm_create();
+int vm_map_io(struct lc3_vm *vm, uint16_t address, io_read_f read, io_write_f write);
+void vm_reset(struct lc3_vm *vm);
+void vm_destroy(struct lc3_vm *vm);
+void start(struct lc3_vm *vm, uint16_t offset);
+void vm_run(struct lc3_vm *vm);
+void vm_step(struct lc3_vm *vm);
+
+#endif
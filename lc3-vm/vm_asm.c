@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vm_asm.h"
+
+// Symbol table: names in one pool, a hash by name for the assembler and an
+// index by address (built after each source) for the profiler and debugger
+struct lc3_sym {
+    uint32_t name;                     // Offset in names[], NUL terminated
+    uint16_t len;
+    uint16_t addr;
+};
+
+struct lc3_syms {
+    char *names;
+    size_t nlen, ncap;
+    struct lc3_sym *sym;
+    uint32_t n, cap;
+    uint32_t *hash;                    // Symbol index + 1, 0 for an empty slot
+    uint32_t hcap;                     // Power of two
+    uint32_t *by_addr;                 // Indices sorted by address, first nsorted
+    uint32_t nsorted;
+    struct { uint16_t lo, hi; } *blocks;   // Assembled ranges, for label+offset
+    uint32_t nblocks, bcap;
+};
+
+static uint32_t hash_name(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t k = 0; k < len; k++) {
+        h = (h ^ (uint8_t)p[k]) * 16777619u;
+    }
+    return h;
+}
+
+struct lc3_syms *sym_create(void) {
+    return calloc(1, sizeof(struct lc3_syms));
+}
+
+void sym_destroy(struct lc3_syms *s) {
+    if (s == NULL) {
+        return;
+    }
+    free(s->names);
+    free(s->sym);
+    free(s->hash);
+    free(s->by_addr);
+    free(s->blocks);
+    free(s);
+}
+
+static uint32_t *sym_slot(const struct lc3_syms *s, const char *name, size_t len) {
+    uint32_t mask = s->hcap - 1;
+    for (uint32_t h = hash_name(name, len) & mask;; h = (h + 1) & mask) {
+        uint32_t i = s->hash[h];
+        if (i == 0 || (s->sym[i - 1].len == len && memcmp(s->names + s->sym[i - 1].name, name, len) == 0)) {
+            return &s->hash[h];
+        }
+    }
+}
+
+bool sym_find(const struct lc3_syms *s, const char *name, size_t len, uint16_t *addr) {
+    if (s == NULL || s->hcap == 0) {
+        return false;
+    }
+    uint32_t i = *sym_slot(s, name, len);
+    if (i) *addr = s->sym[i - 1].addr;
+    return i != 0;
+}
+
+// 0, -1 if the name is taken, -2 out of memory
+static int sym_add(struct lc3_syms *s, const char *name, size_t len, uint16_t addr) {
+    if ((s->n + 1) * 2 > s->hcap) {
+        uint32_t hcap = s->hcap ? s->hcap * 2 : 1024;
+        uint32_t *hash = calloc(hcap, sizeof(uint32_t));
+        if (hash == NULL) return -2;
+        free(s->hash);
+        s->hash = hash;
+        s->hcap = hcap;
+        for (uint32_t i = 0; i < s->n; i++) {
+            *sym_slot(s, s->names + s->sym[i].name, s->sym[i].len) = i + 1;
+        }
+    }
+    uint32_t *slot = sym_slot(s, name, len);
+    if (*slot) {
+        return -1;
+    }
+    if (s->n == s->cap) {
+        uint32_t cap = s->cap ? s->cap * 2 : 256;
+        struct lc3_sym *sym = realloc(s->sym, cap * sizeof(*sym));
+        if (sym == NULL) return -2;
+        s->sym = sym;
+        s->cap = cap;
+    }
+    if (s->nlen + len + 1 > s->ncap) {
+        size_t ncap = s->ncap ? s->ncap : 4096;
+        while (s->nlen + len + 1 > ncap) ncap *= 2;
+        char *names = realloc(s->names, ncap);
+        if (names == NULL) return -2;
+        s->names = names;
+        s->ncap = ncap;
+    }
+    memcpy(s->names + s->nlen, name, len);
+    s->names[s->nlen + len] = 0;
+    s->sym[s->n] = (struct lc3_sym){ s->nlen, len, addr };
+    s->nlen += len + 1;
+    *slot = ++s->n;
+    return 0;
+}
+
+static void sym_block(struct lc3_syms *s, uint16_t lo, uint16_t hi) {
+    if (s->nblocks == s->bcap) {
+        uint32_t cap = s->bcap ? s->bcap * 2 : 8;
+        void *b = realloc(s->blocks, cap * sizeof(*s->blocks));
+        if (b == NULL) return;
+        s->blocks = b;
+        s->bcap = cap;
+    }
+    s->blocks[s->nblocks].lo = lo;
+    s->blocks[s->nblocks].hi = hi;
+    s->nblocks++;
+}
+
+// Sort keys carry the address above the index, so the comparator needs no
+// pointer back to the table and any number of VMs can sort at once
+static int by_key(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void sym_sort(struct lc3_syms *s) {
+    uint64_t *key = malloc((s->n ? s->n : 1) * sizeof(uint64_t));
+    uint32_t *idx = key ? realloc(s->by_addr, (s->n ? s->n : 1) * sizeof(uint32_t)) : NULL;
+    if (idx == NULL) {
+        free(key);
+        return;
+    }
+    s->by_addr = idx;
+    for (uint32_t i = 0; i < s->n; i++) key[i] = (uint64_t)s->sym[i].addr << 32 | i;
+    qsort(key, s->n, sizeof(uint64_t), by_key);
+    for (uint32_t i = 0; i < s->n; i++) idx[i] = (uint32_t)key[i];
+    free(key);
+    s->nsorted = s->n;
+}
+
+// Label at addr, or the nearest one below it in the same assembled block
+// with *off set to the distance; NULL if there is none
+const char *sym_at(const struct lc3_syms *s, uint16_t addr, uint16_t *off) {
+    if (s == NULL || s->nsorted == 0) {
+        return NULL;
+    }
+    uint32_t lo = 0, hi = s->nsorted;      // First entry above addr
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (s->sym[s->by_addr[mid]].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    uint16_t at = s->sym[s->by_addr[lo - 1]].addr;
+    while (lo > 1 && s->sym[s->by_addr[lo - 2]].addr == at) lo--;   // First defined wins
+    if (at != addr) {
+        uint32_t b = 0;
+        while (b < s->nblocks && !(s->blocks[b].lo <= addr && addr <= s->blocks[b].hi)) b++;
+        if (b == s->nblocks || at < s->blocks[b].lo) {
+            return NULL;
+        }
+    }
+    *off = addr - at;
+    return s->names + s->sym[s->by_addr[lo - 1]].name;
+}
+
+// "LABEL", "LABEL+3" or "0x3004"
+int sym_format(const struct lc3_syms *s, uint16_t addr, char *buf, size_t size) {
+    uint16_t off;
+    const char *name = sym_at(s, addr, &off);
+    if (name == NULL) return snprintf(buf, size, "0x%04X", addr);
+    if (off == 0) return snprintf(buf, size, "%s", name);
+    return snprintf(buf, size, "%s+%u", name, off);
+}
+
+// Assembler
+
+enum kind {
+    M_ALU,                             // ADD/AND DR, SR1, SR2|imm5
+    M_NOT,                             // NOT DR, SR
+    M_BR,                              // BRnzp label
+    M_JMP,                             // JMP/JSRR BaseR
+    M_JSR,                             // JSR label
+    M_MEM9,                            // LD/LDI/LEA/ST/STI R, label
+    M_MEM6,                            // LDR/STR R, BaseR, offset6
+    M_TRAP,                            // TRAP trapvect8
+    M_FIXED,                           // No operands
+    D_ORIG, D_FILL, D_BLKW, D_STRINGZ, D_END
+};
+
+static const struct mnem {
+    const char *name;
+    uint8_t kind;
+    uint16_t base;
+} mnems[] = {
+    { "ADD", M_ALU, 0x1000 }, { "AND", M_ALU, 0x5000 }, { "NOT", M_NOT, 0x903F },
+    { "BR", M_BR, 0x0E00 }, { "BRN", M_BR, 0x0800 }, { "BRZ", M_BR, 0x0400 }, { "BRP", M_BR, 0x0200 },
+    { "BRNZ", M_BR, 0x0C00 }, { "BRNP", M_BR, 0x0A00 }, { "BRZP", M_BR, 0x0600 }, { "BRNZP", M_BR, 0x0E00 },
+    { "JMP", M_JMP, 0xC000 }, { "RET", M_FIXED, 0xC1C0 }, { "JSR", M_JSR, 0x4800 }, { "JSRR", M_JMP, 0x4000 },
+    { "LD", M_MEM9, 0x2000 }, { "LDI", M_MEM9, 0xA000 }, { "LEA", M_MEM9, 0xE000 },
+    { "ST", M_MEM9, 0x3000 }, { "STI", M_MEM9, 0xB000 },
+    { "LDR", M_MEM6, 0x6000 }, { "STR", M_MEM6, 0x7000 },
+    { "RTI", M_FIXED, 0x8000 }, { "RES", M_FIXED, 0xD000 }, { "TRAP", M_TRAP, 0xF000 },
+    { "GETC", M_FIXED, 0xF020 }, { "OUT", M_FIXED, 0xF021 }, { "PUTS", M_FIXED, 0xF022 },
+    { "IN", M_FIXED, 0xF023 }, { "PUTSP", M_FIXED, 0xF024 }, { "HALT", M_FIXED, 0xF025 },
+    { "INU16", M_FIXED, 0xF026 }, { "OUTU16", M_FIXED, 0xF027 },
+    { ".ORIG", D_ORIG, 0 }, { ".FILL", D_FILL, 0 }, { ".BLKW", D_BLKW, 0 },
+    { ".STRINGZ", D_STRINGZ, 0 }, { ".END", D_END, 0 },
+};
+
+// Label reference patched into a word once the label is known
+enum fix { FIX_OFF9, FIX_OFF11, FIX_WORD };
+
+struct fixup {
+    uint16_t at;
+    uint8_t kind;
+    uint32_t line;
+    const char *name;                  // Into the source
+    uint16_t len;
+};
+
+struct as {
+    struct lc3_vm *vm;
+    struct lc3_syms *syms;
+    const char *fname;
+    uint32_t line;
+    uint32_t pc;                       // Location counter, may run past 0xFFFF
+    bool in_block;                     // Between .ORIG and .END
+    uint16_t block_lo;
+    bool have_origin;
+    uint16_t origin;
+    long words;
+    int errors;
+
+    struct fixup *fix;
+    size_t nfix, capfix;
+};
+
+struct tok {
+    const char *p;
+    int len;
+};
+
+static void as_error(struct as *a, uint32_t line, const char *fmt, ...) {
+    va_list ap;
+    if (a->errors++ >= 20) {
+        return;                        // The first ones are enough
+    }
+    fprintf(stderr, "%s:%u: ", a->fname, line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static inline bool is_delim(char c) {
+    return c == 0 || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ';';
+}
+
+// Next operand or word; len 0 at the end of the line or a comment
+static const char *get_tok(const char *p, struct tok *t) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == ',') p++;
+    t->p = p;
+    if (*p != ';') {
+        while (!is_delim(*p)) p++;
+    }
+    t->len = p - t->p;
+    return p;
+}
+
+static const struct mnem *lookup(struct tok t) {
+    char up[10];
+    if (t.len == 0 || t.len >= (int)sizeof(up)) {
+        return NULL;
+    }
+    for (int k = 0; k < t.len; k++) {
+        up[k] = t.p[k] >= 'a' && t.p[k] <= 'z' ? t.p[k] - 32 : t.p[k];
+    }
+    up[t.len] = 0;
+    for (size_t m = 0; m < sizeof(mnems) / sizeof(mnems[0]); m++) {
+        if (mnems[m].name[0] == up[0] && strcmp(mnems[m].name, up) == 0) {
+            return &mnems[m];
+        }
+    }
+    return NULL;
+}
+
+static int digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 99;
+}
+
+// #-12, x3000, 0x3000, 12; false if t is not a number
+static bool tok_num(struct tok t, int32_t *v) {
+    const char *p = t.p, *e = t.p + t.len;
+    int base = 10;
+    bool neg = false;
+    if (p < e && *p == '#') {
+        p++;
+    } else if (p < e && (*p == 'x' || *p == 'X')) {
+        base = 16;
+        p++;
+    } else if (e - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    if (p < e && (*p == '-' || *p == '+')) {
+        neg = *p++ == '-';
+    }
+    if (p == e) {
+        return false;
+    }
+    int64_t n = 0;
+    for (; p < e; p++) {
+        int d = digit(*p);
+        if (d >= base) return false;
+        if (n <= 0x1FFFF) n = n * base + d;
+    }
+    *v = neg ? -n : n;
+    return true;
+}
+
+static bool tok_reg(struct tok t, int *r) {
+    if (t.len == 2 && (t.p[0] == 'R' || t.p[0] == 'r') && t.p[1] >= '0' && t.p[1] <= '7') {
+        *r = t.p[1] - '0';
+        return true;
+    }
+    return false;
+}
+
+static bool tok_label(struct tok t) {
+    if (t.len == 0 || t.len > 255 || !(t.p[0] == '_' || ((t.p[0] | 32) >= 'a' && (t.p[0] | 32) <= 'z'))) {
+        return false;
+    }
+    for (int k = 1; k < t.len; k++) {
+        char c = t.p[k];
+        if (!(c == '_' || (c >= '0' && c <= '9') || ((c | 32) >= 'a' && (c | 32) <= 'z'))) return false;
+    }
+    return true;
+}
+
+static void emit(struct as *a, uint16_t w) {
+    if (a->pc > UINT16_MAX) {
+        if (a->pc++ == MEM_WORDS) as_error(a, a->line, "program runs past 0xFFFF");
+        return;
+    }
+    a->vm->mem[a->pc] = w;
+    vm_touch(a->vm, a->pc);
+    a->pc++;
+    a->words++;
+}
+
+// Fill in a label's address; the instruction is at `at`
+static void patch(struct as *a, uint16_t at, int kind, uint16_t target, uint32_t line) {
+    int32_t off = (int32_t)target - (at + 1);
+    switch (kind) {
+        case FIX_OFF9:
+            if (off < -256 || off > 255) {
+                as_error(a, line, "label is %d words away, more than a 9-bit offset reaches", off);
+                return;
+            }
+            a->vm->mem[at] |= off & 0x1FF;
+            break;
+        case FIX_OFF11:
+            if (off < -1024 || off > 1023) {
+                as_error(a, line, "label is %d words away, more than an 11-bit offset reaches", off);
+                return;
+            }
+            a->vm->mem[at] |= off & 0x7FF;
+            break;
+        default:
+            a->vm->mem[at] = target;
+            break;
+    }
+}
+
+// Operands
+
+static bool need_reg(struct as *a, const char **p, int *r) {
+    struct tok t;
+    *p = get_tok(*p, &t);
+    if (!tok_reg(t, r)) {
+        as_error(a, a->line, t.len ? "expected a register, got '%.*s'" : "missing register operand", t.len, t.p);
+        return false;
+    }
+    return true;
+}
+
+static bool need_num(struct as *a, const char **p, int32_t lo, int32_t hi, int32_t *v) {
+    struct tok t;
+    *p = get_tok(*p, &t);
+    if (!tok_num(t, v)) {
+        as_error(a, a->line, t.len ? "expected a number, got '%.*s'" : "missing number operand", t.len, t.p);
+        return false;
+    }
+    if (*v < lo || *v > hi) {
+        as_error(a, a->line, "%d is out of range (%d to %d)", *v, lo, hi);
+        return false;
+    }
+    return true;
+}
+
+// Label or number into the word about to be emitted at pc. A number is the
+// field itself (offset or word), a label is resolved now or at the end.
+static bool need_ref(struct as *a, const char **p, int kind, uint16_t *w) {
+    struct tok t;
+    int32_t v;
+    *p = get_tok(*p, &t);
+    if (tok_num(t, &v)) {
+        static const int32_t lim[][2] = { { -256, 255 }, { -1024, 1023 }, { -32768, 65535 } };
+        if (v < lim[kind][0] || v > lim[kind][1]) {
+            as_error(a, a->line, "%d is out of range (%d to %d)", v, lim[kind][0], lim[kind][1]);
+            return false;
+        }
+        *w |= kind == FIX_OFF9 ? (v & 0x1FF) : kind == FIX_OFF11 ? (v & 0x7FF) : (uint16_t)v;
+        return true;
+    }
+    if (!tok_label(t)) {
+        as_error(a, a->line, t.len ? "expected a label or number, got '%.*s'" : "missing operand", t.len, t.p);
+        return false;
+    }
+    uint16_t target;
+    if (sym_find(a->syms, t.p, t.len, &target)) {
+        uint16_t at = a->pc;
+        a->vm->mem[at] = *w;           // patch() works on memory
+        patch(a, at, kind, target, a->line);
+        *w = a->vm->mem[at];
+        return true;
+    }
+    if (a->nfix == a->capfix) {
+        size_t cap = a->capfix ? a->capfix * 2 : 1024;
+        struct fixup *f = realloc(a->fix, cap * sizeof(*f));
+        if (f == NULL) {
+            as_error(a, a->line, "out of memory");
+            return false;
+        }
+        a->fix = f;
+        a->capfix = cap;
+    }
+    a->fix[a->nfix++] = (struct fixup){ a->pc, kind, a->line, t.p, t.len };
+    return true;
+}
+
+static const char *stringz(struct as *a, const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '"') {
+        as_error(a, a->line, ".STRINGZ needs a quoted string");
+        return p;
+    }
+    for (p++; *p != '"'; p++) {
+        if (*p == 0 || *p == '\n') {
+            as_error(a, a->line, "unterminated string");
+            return p;
+        }
+        char c = *p;
+        if (c == '\\') {
+            switch (*++p) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = 0; break;
+                case 'e': c = 27; break;
+                case '\\': case '"': c = *p; break;
+                case 0: case '\n':
+                    as_error(a, a->line, "unterminated string");
+                    return p;
+                default:
+                    as_error(a, a->line, "unknown escape \\%c", *p);
+                    c = *p;
+                    break;
+            }
+        }
+        emit(a, (uint8_t)c);
+    }
+    emit(a, 0);
+    return p + 1;
+}
+
+static void end_block(struct as *a) {
+    if (a->in_block && a->pc > a->block_lo) {
+        sym_block(a->syms, a->block_lo, a->pc > UINT16_MAX ? UINT16_MAX : a->pc - 1);
+    }
+    a->in_block = false;
+}
+
+static void as_line(struct as *a, const char *p) {
+    struct tok t;
+    p = get_tok(p, &t);
+    if (t.len == 0) {
+        return;
+    }
+    const struct mnem *m = lookup(t);
+    if (m == NULL) {
+        int len = t.len > 1 && t.p[t.len - 1] == ':' ? t.len - 1 : t.len;
+        struct tok l = { t.p, len };
+        if (!tok_label(l)) {
+            as_error(a, a->line, "unknown instruction '%.*s'", t.len, t.p);
+            return;
+        }
+        if (!a->in_block) {
+            as_error(a, a->line, "label '%.*s' outside .ORIG/.END", len, t.p);
+        } else {
+            int rc = a->pc > UINT16_MAX ? 0 : sym_add(a->syms, l.p, l.len, a->pc);
+            if (rc == -1) as_error(a, a->line, "label '%.*s' defined twice", len, t.p);
+            if (rc == -2) as_error(a, a->line, "out of memory");
+        }
+        p = get_tok(p, &t);
+        if (t.len == 0) {
+            return;
+        }
+        if ((m = lookup(t)) == NULL) {
+            as_error(a, a->line, "unknown instruction '%.*s'", t.len, t.p);
+            return;
+        }
+    }
+    if (m->kind != D_ORIG && !a->in_block) {
+        as_error(a, a->line, "%s outside .ORIG/.END", m->name);
+        return;
+    }
+
+    uint16_t w = m->base;
+    int r1, r2, r3;
+    int32_t v;
+    switch (m->kind) {
+        case M_ALU: {
+            if (!need_reg(a, &p, &r1) || !need_reg(a, &p, &r2)) return;
+            p = get_tok(p, &t);
+            if (tok_reg(t, &r3)) {
+                w |= r1 << 9 | r2 << 6 | r3;
+            } else if (tok_num(t, &v) && v >= -16 && v <= 15) {
+                w |= r1 << 9 | r2 << 6 | 1 << 5 | (v & 0x1F);
+            } else if (t.len == 0) {
+                as_error(a, a->line, "missing third operand");
+                return;
+            } else {
+                as_error(a, a->line, "expected a register or an immediate from -16 to 15, got '%.*s'", t.len, t.p);
+                return;
+            }
+            break;
+        }
+        case M_NOT:
+            if (!need_reg(a, &p, &r1) || !need_reg(a, &p, &r2)) return;
+            w |= r1 << 9 | r2 << 6;
+            break;
+        case M_BR:
+            if (!need_ref(a, &p, FIX_OFF9, &w)) return;
+            break;
+        case M_JMP:
+            if (!need_reg(a, &p, &r1)) return;
+            w |= r1 << 6;
+            break;
+        case M_JSR:
+            if (!need_ref(a, &p, FIX_OFF11, &w)) return;
+            break;
+        case M_MEM9:
+            if (!need_reg(a, &p, &r1)) return;
+            w |= r1 << 9;
+            if (!need_ref(a, &p, FIX_OFF9, &w)) return;
+            break;
+        case M_MEM6:
+            if (!need_reg(a, &p, &r1) || !need_reg(a, &p, &r2) || !need_num(a, &p, -32, 31, &v)) return;
+            w |= r1 << 9 | r2 << 6 | (v & 0x3F);
+            break;
+        case M_TRAP:
+            if (!need_num(a, &p, 0, 255, &v)) return;
+            w |= v;
+            break;
+        case M_FIXED:
+            break;
+        case D_ORIG:
+            if (!need_num(a, &p, 0, UINT16_MAX, &v)) return;
+            end_block(a);
+            a->in_block = true;
+            a->pc = a->block_lo = v;
+            if (!a->have_origin) {
+                a->have_origin = true;
+                a->origin = v;
+            }
+            break;
+        case D_FILL:
+            if (!need_ref(a, &p, FIX_WORD, &w)) return;
+            break;
+        case D_BLKW:
+            if (!need_num(a, &p, 0, MEM_WORDS, &v)) return;
+            while (v-- > 0) emit(a, 0);
+            break;
+        case D_STRINGZ:
+            p = stringz(a, p);
+            break;
+        case D_END:
+            end_block(a);
+            break;
+    }
+    if (m->kind < D_ORIG || m->kind == D_FILL) {
+        emit(a, w);
+    }
+
+    p = get_tok(p, &t);
+    if (t.len) {
+        as_error(a, a->line, "unexpected '%.*s' after %s", t.len, t.p, m->name);
+    }
+}
+
+// Assemble NUL-terminated source into vm->mem; name is used in messages.
+// Returns the number of words written, or -1 after printing the errors.
+long asm_text(struct lc3_vm *vm, const char *src, const char *name, uint16_t *origin) {
+    if (vm->syms == NULL && (vm->syms = sym_create()) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return -1;
+    }
+    struct as a = { .vm = vm, .syms = vm->syms, .fname = name };
+
+    for (const char *p = src; *p;) {
+        a.line++;
+        as_line(&a, p);
+        const char *nl = strchr(p, '\n');
+        if (nl == NULL) break;
+        p = nl + 1;
+    }
+    end_block(&a);
+
+    for (size_t k = 0; k < a.nfix; k++) {
+        struct fixup *f = &a.fix[k];
+        uint16_t target;
+        if (!sym_find(a.syms, f->name, f->len, &target)) {
+            as_error(&a, f->line, "undefined label '%.*s'", f->len, f->name);
+            continue;
+        }
+        patch(&a, f->at, f->kind, target, f->line);
+    }
+    free(a.fix);
+    sym_sort(a.syms);
+
+    if (!a.have_origin && a.errors == 0) {
+        as_error(&a, 1, "no .ORIG");
+    }
+    if (a.errors) {
+        if (a.errors > 20) fprintf(stderr, "%s: %d errors\n", name, a.errors);
+        return -1;
+    }
+    if (origin) *origin = a.origin;
+    return a.words;
+}
+
+long asm_file(struct lc3_vm *vm, const char *fname, uint16_t *origin) {
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *src = malloc(st.st_size + 1);
+    size_t n = 0;
+    ssize_t r;
+    while (src && n < (size_t)st.st_size && (r = read(fd, src + n, st.st_size - n)) > 0) {
+        n += r;
+    }
+    close(fd);
+    if (src == NULL) {
+        fprintf(stderr, "Error: Could not read from file %s\n", fname);
+        return -1;
+    }
+    src[n] = 0;
+    long words = asm_text(vm, src, fname, origin);
+    free(src);
+    return words;
+}
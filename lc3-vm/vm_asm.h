@@ -0,0 +1,32 @@
+#ifndef VM_ASM_H
+#define VM_ASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+// LC-3 assembler that writes straight into a VM's memory. One pass over the
+// source: labels go into a hash table as they are defined, references to
+// labels further down are patched once the source is read.
+//
+// Syntax as in the LC-3 book: `;` comments, an optional label (with or
+// without `:`) in front of each line, mnemonics and directives in any case,
+// labels case sensitive. Numbers are #decimal, xHEX, 0xHEX or decimal.
+// Besides the 15 instructions, RES (opcode 13), the trap aliases (GETC,
+// OUT, PUTS, IN, PUTSP, HALT, INU16, OUTU16) and .ORIG, .FILL, .BLKW,
+// .STRINGZ, .END are known. A file may hold several .ORIG blocks.
+long asm_text(struct lc3_vm *vm, const char *src, const char *name, uint16_t *origin);
+long asm_file(struct lc3_vm *vm, const char *fname, uint16_t *origin);
+
+// Labels of everything assembled into a VM (vm->syms)
+struct lc3_syms;
+
+struct lc3_syms *sym_create(void);
+void sym_destroy(struct lc3_syms *s);
+bool sym_find(const struct lc3_syms *s, const char *name, size_t len, uint16_t *addr);
+const char *sym_at(const struct lc3_syms *s, uint16_t addr, uint16_t *off);
+int sym_format(const struct lc3_syms *s, uint16_t addr, char *buf, size_t size);
+
+#endif
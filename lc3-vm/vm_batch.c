@@ -0,0 +1,36 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "vm_batch.h"
+
+// Result record plus the captured output in one writev(), 0 or -1
+int batch_write(int fd, const struct lc3_vm *vm, uint16_t flags, uint64_t ns) {
+    struct lc3_result r = { RESULT_MAGIC, RESULT_VERSION, flags };
+    memcpy(r.reg, vm->reg, sizeof(r.reg));
+    r.out_len = vm->io.capture ? vm->io.cap_len : 0;
+    r.ns = ns;
+
+    struct iovec iov[2] = {
+        { &r, sizeof(r) },
+        { vm->io.cap, r.out_len }
+    };
+    size_t left = sizeof(r) + r.out_len;
+    int n = 2, k = 0;
+    while (left > 0) {
+        ssize_t w = writev(fd, iov + k, n - k);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        left -= w;
+        while (k < n && (size_t)w >= iov[k].iov_len) {
+            w -= iov[k].iov_len;
+            k++;
+        }
+        if (k < n) {
+            iov[k].iov_base = (char *)iov[k].iov_base + w;
+            iov[k].iov_len -= w;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef VM_BATCH_H
+#define VM_BATCH_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#define RESULT_MAGIC "LC3R"
+#define RESULT_VERSION 1
+
+// Result flags
+#define RESULT_HALTED      (1 << 0)    // Stopped by HALT or MCR, not cut short
+#define RESULT_LOAD_FAIL   (1 << 1)    // No program could be loaded, nothing ran
+#define RESULT_REPLAY_FAIL (1 << 2)    // Stopped by the -R log (diverged, ran out,
+                                       // corrupt), never set with RESULT_HALTED
+
+// One record per batch run, host byte order, followed by out_len bytes of
+// console output
+struct lc3_result {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint16_t reg[RCNT];                // R0-R7, PC, COND after the run
+    uint32_t out_len;
+    uint64_t ns;                       // Wall time of the run
+};
+
+int batch_write(int fd, const struct lc3_vm *vm, uint16_t flags, uint64_t ns);
+
+#endif
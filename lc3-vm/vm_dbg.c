@@ -1,5 +1,12 @@
+#include <string.h>
+
 #include "vm_dbg.h"
 
+const char *const op_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
 // DEBUG
 void fprintf_binary(FILE *f, uint16_t num) {
     int c = 16;
@@ -25,14 +32,117 @@ void fprintf_mem(FILE *f, uint16_t *mem, uint16_t from, uint16_t to) {
     }
 }
 
+// One "mem[N|0xhhhh]= bbbb bbbb bbbb bbbb\n" line, same text as fprintf_mem()
+static const char nibble_bits[16][4] = {
+    {'0','0','0','0'}, {'0','0','0','1'}, {'0','0','1','0'}, {'0','0','1','1'},
+    {'0','1','0','0'}, {'0','1','0','1'}, {'0','1','1','0'}, {'0','1','1','1'},
+    {'1','0','0','0'}, {'1','0','0','1'}, {'1','0','1','0'}, {'1','0','1','1'},
+    {'1','1','0','0'}, {'1','1','0','1'}, {'1','1','1','0'}, {'1','1','1','1'}
+};
+static const char hex_digits[] = "0123456789abcdef";
+
+#define MEM_LINE_MAX 48
+
+static int fmt_mem_line(char *p, uint32_t addr, uint16_t v) {
+    char dec[5];
+    int nd = 0, n;
+    uint32_t a = addr;
+    do { dec[nd++] = '0' + a % 10; a /= 10; } while (a);
+
+    memcpy(p, "mem[", 4); n = 4;
+    while (nd) p[n++] = dec[--nd];
+    memcpy(p + n, "|0x", 3); n += 3;
+    for (int sh = 12; sh >= 0; sh -= 4) p[n++] = hex_digits[(addr >> sh) & 0xF];
+    memcpy(p + n, "]=", 2); n += 2;
+    for (int sh = 12; sh >= 0; sh -= 4) {
+        p[n++] = ' ';
+        memcpy(p + n, nibble_bits[(v >> sh) & 0xF], 4);
+        n += 4;
+    }
+    p[n++] = '\n';
+    return n;
+}
+
+// Nonzero words of [from, to) into buf, flushed to f whenever it fills up
+static size_t fmt_nonzero(FILE *f, char *buf, size_t len, size_t size,
+                          const uint16_t *mem, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        if (mem[i] == 0) continue;
+        if (len + MEM_LINE_MAX > size) {
+            fwrite(buf, 1, len, f);
+            len = 0;
+        }
+        len += fmt_mem_line(buf + len, i, mem[i]);
+    }
+    return len;
+}
+
 void fprintf_mem_nonzero(FILE *f, uint16_t *mem, uint32_t stop) {
-    for(int i = 0; i < stop; i++) {
-        if (mem[i]!=0) {
-            fprintf(f, "mem[%d|0x%.04x]=", i, i);
-            fprintf_binary(f, mem[i]);
-            fprintf(f, "\n"); 
+    char buf[1 << 14];
+    size_t len = fmt_nonzero(f, buf, 0, sizeof(buf), mem, 0, stop);
+    fwrite(buf, 1, len, f);
+}
+
+// Same report as fprintf_mem_nonzero(), but only pages marked in the bitmap
+// are looked at (64 words per bit); every other page must be all zero.
+void fprintf_mem_pages(FILE *f, const uint16_t *mem, const uint64_t *pages, uint32_t stop) {
+    char buf[1 << 14];
+    size_t len = 0;
+    for (uint32_t w = 0; w * 64 * 64 < stop; w++) {
+        for (uint64_t bits = pages[w]; bits; bits &= bits - 1) {
+            uint32_t from = (w * 64 + __builtin_ctzll(bits)) * 64;
+            uint32_t to = from + 64 < stop ? from + 64 : stop;
+            len = fmt_nonzero(f, buf, len, sizeof(buf), mem, from, to);
+        }
+    }
+    fwrite(buf, 1, len, f);
+}
+
+// Copy of the pages marked in the bitmap, zero elsewhere; NULL if out of memory
+uint16_t *mem_copy_pages(const uint16_t *mem, const uint64_t *pages) {
+    uint16_t *copy = calloc(1 << 16, sizeof(uint16_t));
+    if (copy == NULL) {
+        return NULL;
+    }
+    for (uint32_t w = 0; w < (1 << 16) / 64 / 64; w++) {
+        for (uint64_t bits = pages[w]; bits; bits &= bits - 1) {
+            uint32_t from = (w * 64 + __builtin_ctzll(bits)) * 64;
+            memcpy(copy + from, mem + from, 64 * sizeof(uint16_t));
+        }
+    }
+    return copy;
+}
+
+// Words of the marked pages that differ from before, as
+// "mem[N|0xhhhh]= <new> (was <old>)" lines
+void fprintf_mem_diff(FILE *f, const uint16_t *mem, const uint16_t *before,
+                      const uint64_t *pages, uint32_t stop) {
+    char buf[1 << 14];
+    size_t len = 0;
+    for (uint32_t w = 0; w * 64 * 64 < stop; w++) {
+        for (uint64_t bits = pages[w]; bits; bits &= bits - 1) {
+            uint32_t from = (w * 64 + __builtin_ctzll(bits)) * 64;
+            uint32_t to = from + 64 < stop ? from + 64 : stop;
+            for (uint32_t i = from; i < to; i++) {
+                if (mem[i] == before[i]) continue;
+                if (len + 2 * MEM_LINE_MAX > sizeof(buf)) {
+                    fwrite(buf, 1, len, f);
+                    len = 0;
+                }
+                len += fmt_mem_line(buf + len, i, mem[i]) - 1;
+                memcpy(buf + len, " (was", 5);
+                len += 5;
+                for (int sh = 12; sh >= 0; sh -= 4) {
+                    buf[len++] = ' ';
+                    memcpy(buf + len, nibble_bits[(before[i] >> sh) & 0xF], 4);
+                    len += 4;
+                }
+                memcpy(buf + len, ")\n", 2);
+                len += 2;
+            }
         }
     }
+    fwrite(buf, 1, len, f);
 }
 
 void fprintf_reg(FILE *f, uint16_t *reg, int idx) {
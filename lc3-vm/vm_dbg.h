@@ -2,9 +2,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+extern const char *const op_names[16];
+
 void fprintf_binary(FILE *f, uint16_t num);
 void fprintf_inst(FILE *f, uint16_t instr);
 void fprintf_mem(FILE *f, uint16_t *mem, uint16_t from, uint16_t to);
 void fprintf_mem_nonzero(FILE *f, uint16_t *mem, uint32_t stop);
+void fprintf_mem_pages(FILE *f, const uint16_t *mem, const uint64_t *pages, uint32_t stop);
+uint16_t *mem_copy_pages(const uint16_t *mem, const uint64_t *pages);
+void fprintf_mem_diff(FILE *f, const uint16_t *mem, const uint16_t *before,
+                      const uint64_t *pages, uint32_t stop);
 void fprintf_reg(FILE *f, uint16_t *reg, int idx);
 void fprintf_reg_all(FILE *f, uint16_t *reg, int size);
\ No newline at end of file
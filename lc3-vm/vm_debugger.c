@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vm_debugger.h"
+#include "vm_asm.h"
+#include "vm_dbg.h"
+#include "vm_replay.h"
+
+// State at one instruction count. pages[] holds the pages first written
+// after this checkpoint as they were here; applying the lists from the
+// newest down to this one brings memory back to this point.
+struct ckpt {
+    uint64_t icount;
+    uint16_t reg[RCNT];
+    struct lc3_sys sys;
+    uint64_t dirty[NPAGES / 64];
+    uint16_t io[IO_WORDS];             // Devices write their registers behind mw()'s back
+    struct replay_mark input;
+
+    uint16_t *pages;                   // npages * PAGE_WORDS words
+    uint16_t *ids;
+    int npages, cap;
+};
+
+struct lc3_debugger {
+    struct lc3_vm *vm;
+    struct ckpt *ck;                   // Oldest first, CKPT_MAX slots
+    int n;
+    uint64_t hw;                       // Furthest icount reached; output below it was shown
+
+    uint64_t bp[MEM_WORDS / 64];       // Breakpoint bitmap
+    struct { uint16_t lo, hi; } watch[MAX_WATCH];
+    int nwatch;
+
+    uint16_t pc;                       // Instruction being stepped
+    bool hit;                          // It wrote a watched range
+    struct dbg_hit last;
+
+    bool quiet;                        // Re-executing, console output is dropped
+    int out_fd;
+    bool own_log;                      // vm->replay was created here, for re-execution
+};
+
+static inline bool bp_test(const struct lc3_debugger *d, uint16_t a) {
+    return d->bp[a >> 6] >> (a & 63) & 1;
+}
+
+static void ckpt_free(struct ckpt *c) {
+    free(c->pages);
+    free(c->ids);
+    c->pages = NULL;
+    c->ids = NULL;
+    c->npages = c->cap = 0;
+}
+
+// Every page is copied on its first write after a checkpoint
+static void arm(struct lc3_debugger *d) {
+    for (int p = 0; p < NPAGES; p++) {
+        d->vm->page_attr[p] |= PAGE_COW;
+    }
+}
+
+static void checkpoint(struct lc3_debugger *d) {
+    struct lc3_vm *vm = d->vm;
+    if (d->n == CKPT_MAX) {
+        ckpt_free(&d->ck[0]);
+        memmove(d->ck, d->ck + 1, (CKPT_MAX - 1) * sizeof(*d->ck));
+        d->n--;
+    }
+    struct ckpt *c = &d->ck[d->n++];
+    memset(c, 0, sizeof(*c));
+    c->icount = vm->sys.icount;
+    memcpy(c->reg, vm->reg, sizeof(c->reg));
+    c->sys = vm->sys;
+    memcpy(c->dirty, vm->dirty, sizeof(c->dirty));
+    memcpy(c->io, vm->mem + IO_START, sizeof(c->io));
+    replay_mark(vm->replay, &c->input);
+    arm(d);
+}
+
+// Back to checkpoint i; the ones after it describe a future that will be
+// run again and are dropped
+static void restore(struct lc3_debugger *d, int i) {
+    struct lc3_vm *vm = d->vm;
+    for (int k = d->n - 1; k >= i; k--) {
+        struct ckpt *c = &d->ck[k];
+        for (int j = 0; j < c->npages; j++) {
+            memcpy(vm->mem + c->ids[j] * PAGE_WORDS, c->pages + j * PAGE_WORDS, PAGE_WORDS * sizeof(uint16_t));
+        }
+        ckpt_free(c);
+    }
+    d->n = i + 1;
+
+    struct ckpt *c = &d->ck[i];
+    memcpy(vm->mem + IO_START, c->io, sizeof(c->io));
+    memcpy(vm->reg, c->reg, sizeof(vm->reg));
+    vm->sys = c->sys;
+    memcpy(vm->dirty, c->dirty, sizeof(vm->dirty));
+    vm->running = true;
+    vm->resched = false;
+    replay_seek(vm->replay, &c->input);
+    arm(d);
+}
+
+// Hook for stores to pages marked PAGE_COW or PAGE_WATCH, before the store
+void debugger_store(struct lc3_debugger *d, uint16_t address, uint16_t val) {
+    struct lc3_vm *vm = d->vm;
+    uint16_t page = address / PAGE_WORDS;
+    if (vm->page_attr[page] & PAGE_COW) {
+        struct ckpt *c = &d->ck[d->n - 1];
+        if (c->npages == c->cap) {
+            int cap = c->cap ? c->cap * 2 : 8;
+            uint16_t *pages = realloc(c->pages, (size_t)cap * PAGE_WORDS * sizeof(uint16_t));
+            uint16_t *ids = pages ? realloc(c->ids, cap * sizeof(uint16_t)) : NULL;
+            if (pages) c->pages = pages;
+            if (ids == NULL) {
+                fprintf(stderr, "Debugger: out of memory for checkpoints\n");
+                return;
+            }
+            c->ids = ids;
+            c->cap = cap;
+        }
+        memcpy(c->pages + c->npages * PAGE_WORDS, vm->mem + page * PAGE_WORDS, PAGE_WORDS * sizeof(uint16_t));
+        c->ids[c->npages++] = page;
+        vm->page_attr[page] &= ~PAGE_COW;
+    }
+    if (vm->page_attr[page] & PAGE_WATCH) {
+        for (int w = 0; w < d->nwatch; w++) {
+            if (address >= d->watch[w].lo && address <= d->watch[w].hi) {
+                d->hit = true;
+                d->last = (struct dbg_hit){ d->pc, address, vm->mem[address], val };
+                break;
+            }
+        }
+    }
+}
+
+// Console output of instructions that already ran once is not shown again
+static void set_quiet(struct lc3_debugger *d, bool q) {
+    struct lc3_io *io = &d->vm->io;
+    if (q == d->quiet) {
+        return;
+    }
+    out_flush(io);
+    pthread_mutex_lock(&io->out_lock);
+    if (q) {
+        d->out_fd = io->out_fd;
+        io->out_fd = -1;
+    } else {
+        io->out_fd = d->out_fd;
+    }
+    pthread_mutex_unlock(&io->out_lock);
+    d->quiet = q;
+}
+
+// One instruction, with a checkpoint first when one is due; false once the
+// machine has stopped
+static bool step1(struct lc3_debugger *d) {
+    struct lc3_vm *vm = d->vm;
+    if (!vm->running) {
+        return false;
+    }
+    if (vm->sys.icount >= d->ck[d->n - 1].icount + CKPT_INTERVAL) {
+        checkpoint(d);
+    }
+    set_quiet(d, vm->sys.icount < d->hw);
+    d->hit = false;
+    d->pc = vm->reg[RPC];
+    vm_step(vm);
+    if (vm->sys.icount > d->hw) {
+        d->hw = vm->sys.icount;
+    }
+    return true;
+}
+
+// Forward to an icount, ignoring breakpoints
+static void run_to(struct lc3_debugger *d, uint64_t target) {
+    while (d->vm->sys.icount < target && step1(d));
+}
+
+// Anywhere in the history, by way of the last checkpoint at or before it
+static void seek(struct lc3_debugger *d, uint64_t target) {
+    int i = d->n - 1;
+    while (i > 0 && d->ck[i].icount > target) i--;
+    restore(d, i);
+    run_to(d, target);
+    set_quiet(d, false);
+}
+
+struct lc3_debugger *debugger_create(struct lc3_vm *vm) {
+    struct lc3_debugger *d = calloc(1, sizeof(*d));
+    if (d == NULL || (d->ck = calloc(CKPT_MAX, sizeof(*d->ck))) == NULL) {
+        free(d);
+        return NULL;
+    }
+    // Re-execution needs the input again, so the debugger always keeps a log
+    if (vm->replay == NULL) {
+        if ((vm->replay = replay_memory()) == NULL) {
+            free(d->ck);
+            free(d);
+            return NULL;
+        }
+        d->own_log = true;
+    }
+    d->vm = vm;
+    vm->dbg = d;
+    d->hw = vm->sys.icount;
+    checkpoint(d);
+    return d;
+}
+
+void debugger_destroy(struct lc3_debugger *d) {
+    if (d == NULL) {
+        return;
+    }
+    set_quiet(d, false);
+    for (int p = 0; p < NPAGES; p++) {
+        d->vm->page_attr[p] &= ~(PAGE_COW | PAGE_WATCH);
+    }
+    for (int i = 0; i < d->n; i++) {
+        ckpt_free(&d->ck[i]);
+    }
+    // The program runs on without us (GDB detach): stop logging its input
+    if (d->own_log) {
+        replay_close(d->vm->replay);
+        d->vm->replay = NULL;
+    }
+    d->vm->dbg = NULL;
+    free(d->ck);
+    free(d);
+}
+
+void debugger_break(struct lc3_debugger *d, uint16_t address, bool on) {
+    if (on) {
+        d->bp[address >> 6] |= 1ULL << (address & 63);
+    } else {
+        d->bp[address >> 6] &= ~(1ULL << (address & 63));
+    }
+}
+
+// Stop after any store to lo..hi; false when all slots are taken
+bool debugger_watch(struct lc3_debugger *d, uint16_t lo, uint16_t hi) {
+    if (d->nwatch == MAX_WATCH || hi < lo) {
+        return false;
+    }
+    d->watch[d->nwatch].lo = lo;
+    d->watch[d->nwatch].hi = hi;
+    d->nwatch++;
+    for (int p = lo / PAGE_WORDS; p <= hi / PAGE_WORDS; p++) {
+        d->vm->page_attr[p] |= PAGE_WATCH;
+    }
+    return true;
+}
+
+// Drop the watchpoints that lie within lo..hi
+void debugger_unwatch(struct lc3_debugger *d, uint16_t lo, uint16_t hi) {
+    int n = 0;
+    for (int w = 0; w < d->nwatch; w++) {
+        if (d->watch[w].lo < lo || d->watch[w].hi > hi) {
+            d->watch[n++] = d->watch[w];
+        }
+    }
+    d->nwatch = n;
+    for (int p = 0; p < NPAGES; p++) {
+        d->vm->page_attr[p] &= ~PAGE_WATCH;
+    }
+    for (int w = 0; w < n; w++) {
+        for (int p = d->watch[w].lo / PAGE_WORDS; p <= d->watch[w].hi / PAGE_WORDS; p++) {
+            d->vm->page_attr[p] |= PAGE_WATCH;
+        }
+    }
+}
+
+// Memory or registers were changed by hand, so the history no longer leads
+// here; it starts again from the current state
+void debugger_forget(struct lc3_debugger *d) {
+    for (int i = 0; i < d->n; i++) {
+        ckpt_free(&d->ck[i]);
+    }
+    d->n = 0;
+    d->hw = d->vm->sys.icount;
+    replay_cut(d->vm->replay);
+    checkpoint(d);
+}
+
+const struct dbg_hit *debugger_hit(const struct lc3_debugger *d) {
+    return &d->last;
+}
+
+// n instructions forward, fewer if a breakpoint or watchpoint is hit
+enum dbg_stop debugger_step(struct lc3_debugger *d, uint64_t n) {
+    for (uint64_t k = 0; k < n; k++) {
+        if (!step1(d)) {
+            return STOP_HALT;
+        }
+        if (d->hit) {
+            return STOP_WATCH;
+        }
+        if (bp_test(d, d->vm->reg[RPC])) {
+            return STOP_BREAK;
+        }
+    }
+    return d->vm->running ? STOP_STEP : STOP_HALT;
+}
+
+enum dbg_stop debugger_continue(struct lc3_debugger *d) {
+    return debugger_step(d, UINT64_MAX);
+}
+
+// Latest point in floor..now-1 where going forward would have stopped. The
+// history is scanned one checkpoint interval at a time, newest first: each
+// interval is run again from its checkpoint, noting the last stop in it.
+static enum dbg_stop reverse(struct lc3_debugger *d, uint64_t floor) {
+    struct lc3_vm *vm = d->vm;
+    uint64_t limit = vm->sys.icount;
+    if (floor < d->ck[0].icount) {
+        floor = d->ck[0].icount;
+    }
+
+    uint64_t end = limit;
+    int i = d->n - 1;
+    while (end > floor) {
+        while (i > 0 && d->ck[i].icount >= end) i--;
+        restore(d, i);
+
+        uint64_t found = 0;
+        enum dbg_stop why = STOP_STEP;
+        struct dbg_hit hit = d->last;
+        while (vm->sys.icount < end) {
+            uint64_t at = vm->sys.icount;
+            if (at >= floor && bp_test(d, vm->reg[RPC])) {
+                found = at;
+                why = STOP_BREAK;
+            }
+            if (!step1(d)) {
+                break;
+            }
+            if (d->hit && vm->sys.icount < limit && vm->sys.icount >= floor) {
+                found = vm->sys.icount;
+                why = STOP_WATCH;
+                hit = d->last;
+            }
+        }
+        if (why != STOP_STEP) {
+            seek(d, found);
+            if (why == STOP_WATCH) {
+                d->last = hit;
+            }
+            return why;
+        }
+        end = d->ck[i].icount;
+    }
+    seek(d, floor);
+    return floor == d->ck[0].icount ? STOP_START : STOP_STEP;
+}
+
+// n instructions back, fewer if a breakpoint or watchpoint is on the way
+enum dbg_stop debugger_back(struct lc3_debugger *d, uint64_t n) {
+    uint64_t now = d->vm->sys.icount;
+    return reverse(d, now > n ? now - n : 0);
+}
+
+enum dbg_stop debugger_reverse_continue(struct lc3_debugger *d) {
+    return reverse(d, 0);
+}
+
+// Command line on the console. It shares the keyboard queue with the
+// program when both read stdin, as -d always did; the terminal is in raw
+// mode then, so the line is echoed here.
+static bool read_line(struct lc3_debugger *d, char *buf, size_t size) {
+    struct lc3_io *io = &d->vm->io;
+    if (io->kbd_fd != STDIN_FILENO) {
+        if (fgets(buf, size, stdin) == NULL) return false;
+        buf[strcspn(buf, "\n")] = 0;
+        return true;
+    }
+    bool echo = isatty(STDIN_FILENO);
+    size_t n = 0;
+    int c;
+    while ((c = kbd_getc(io)) != KBD_EOF && c != '\n') {
+        if ((c == 0x7F || c == '\b') && n > 0) {
+            n--;
+            if (echo) fputs("\b \b", stderr);
+        } else if (c >= ' ' && n + 1 < size) {
+            buf[n++] = c;
+            if (echo) fputc(c, stderr);
+        }
+    }
+    if (echo) fputc('\n', stderr);
+    buf[n] = 0;
+    return c != KBD_EOF || n > 0;
+}
+
+// Numbers as in the assembler: x3000 or 0x3000 for hex, else decimal
+static bool parse_num(const char *s, uint64_t *v) {
+    char *end;
+    if (s == NULL) return false;
+    if (s[0] == 'x' || s[0] == 'X') *v = strtoull(s + 1, &end, 16);
+    else *v = strtoull(s, &end, 0);
+    return end != s && *end == 0;
+}
+
+// Address: a number, a label or label+n
+static bool parse_addr(struct lc3_debugger *d, const char *s, uint64_t *v) {
+    uint16_t a;
+    uint64_t off = 0;
+    if (parse_num(s, v)) return true;
+    if (s == NULL) return false;
+    const char *plus = strchr(s, '+');
+    size_t len = plus ? (size_t)(plus - s) : strlen(s);
+    if ((plus && !parse_num(plus + 1, &off)) || !sym_find(d->vm->syms, s, len, &a)) return false;
+    *v = (a + off) & UINT16_MAX;
+    return true;
+}
+
+static void show(struct lc3_debugger *d, enum dbg_stop why) {
+    struct lc3_vm *vm = d->vm;
+    switch (why) {
+        case STOP_BREAK: fprintf(stderr, "Breakpoint at 0x%04X\n", vm->reg[RPC]); break;
+        case STOP_WATCH:
+            fprintf(stderr, "Watchpoint: 0x%04X 0x%04X -> 0x%04X by PC 0x%04X\n",
+                    d->last.address, d->last.old, d->last.val, d->last.pc);
+            break;
+        case STOP_HALT: fprintf(stderr, "Machine stopped\n"); break;
+        case STOP_START: fprintf(stderr, "Start of history\n"); break;
+        default: break;
+    }
+    uint16_t pc = vm->reg[RPC], instr = vm->mem[pc], off;
+    const char *label = sym_at(vm->syms, pc, &off);
+    fprintf(stderr, "PC: 0x%04X, Instr: 0x%04X, Op: %s, Count: %llu",
+            pc, instr, op_names[OPC(instr)], (unsigned long long)vm->sys.icount);
+    if (label && off) fprintf(stderr, " (%s+%u)", label, off);
+    else if (label) fprintf(stderr, " (%s)", label);
+    fputc('\n', stderr);
+    fprintf(stderr, "Registers: ");
+    for (int i = 0; i <= R7; i++) {
+        fprintf(stderr, "R%d=0x%04X ", i, vm->reg[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+static const char help[] =
+    "  s [n]          step n instructions (Enter: one)\n"
+    "  c              continue to a breakpoint, watchpoint or halt\n"
+    "  rs [n]         step n instructions back\n"
+    "  rc             continue backwards\n"
+    "  b <addr>       set a breakpoint, db <addr> deletes it\n"
+    "  w <lo> [<hi>]  stop after writes to lo..hi, dw deletes all\n"
+    "  x <addr> [n]   show n words of memory\n"
+    "  i              instruction count and checkpoints\n"
+    "  q              quit\n"
+    "  Addresses are numbers, labels or label+n\n";
+
+// Interactive loop for -d: one command per line
+void debugger_main(struct lc3_debugger *d) {
+    struct lc3_vm *vm = d->vm;
+    char line[128];
+    show(d, STOP_STEP);
+    for (;;) {
+        out_flush(&vm->io);
+        fprintf(stderr, "(lc3) ");
+        if (!read_line(d, line, sizeof(line))) {
+            break;
+        }
+        char *cmd = strtok(line, " \t");
+        char *a1 = cmd ? strtok(NULL, " \t") : NULL;
+        char *a2 = a1 ? strtok(NULL, " \t") : NULL;
+        uint64_t v, w;
+
+        if (cmd == NULL || strcmp(cmd, "s") == 0) {
+            show(d, debugger_step(d, parse_num(a1, &v) ? v : 1));
+        } else if (strcmp(cmd, "c") == 0) {
+            show(d, debugger_continue(d));
+        } else if (strcmp(cmd, "rs") == 0) {
+            show(d, debugger_back(d, parse_num(a1, &v) ? v : 1));
+        } else if (strcmp(cmd, "rc") == 0) {
+            show(d, debugger_reverse_continue(d));
+        } else if ((strcmp(cmd, "b") == 0 || strcmp(cmd, "db") == 0) && parse_addr(d, a1, &v)) {
+            debugger_break(d, v, cmd[0] == 'b');
+        } else if (strcmp(cmd, "w") == 0 && parse_addr(d, a1, &v)) {
+            if (!parse_addr(d, a2, &w)) w = v;
+            if (!debugger_watch(d, v, w)) fprintf(stderr, "No watchpoint slot left\n");
+        } else if (strcmp(cmd, "dw") == 0) {
+            debugger_unwatch(d, 0, UINT16_MAX);
+        } else if (strcmp(cmd, "x") == 0 && parse_addr(d, a1, &v)) {
+            if (!parse_num(a2, &w) || w == 0) w = 1;
+            v &= UINT16_MAX;
+            fprintf_mem(stderr, vm->mem, v, v + w > UINT16_MAX ? UINT16_MAX : v + w);
+        } else if (strcmp(cmd, "i") == 0) {
+            fprintf(stderr, "Count %llu, %d checkpoints from %llu, furthest %llu\n",
+                    (unsigned long long)vm->sys.icount, d->n,
+                    (unsigned long long)d->ck[0].icount, (unsigned long long)d->hw);
+        } else if (strcmp(cmd, "q") == 0) {
+            printf("Debug mode: quitting\n");
+            break;
+        } else {
+            fputs(help, stderr);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef VM_DEBUGGER_H
+#define VM_DEBUGGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+// Debugger backend: breakpoints, write watchpoints and reverse execution.
+// Every CKPT_INTERVAL instructions a checkpoint keeps the registers, the
+// device page and, copied on their first write, the pages written until
+// the next one. Going back restores the nearest checkpoint before the
+// target and runs forward again with input from the session's log, so
+// going back costs one interval of re-execution per checkpoint crossed.
+#define CKPT_INTERVAL (1 << 16)        // Instructions between checkpoints
+#define CKPT_MAX 4096                  // The oldest is dropped beyond this
+#define MAX_WATCH 16
+
+enum dbg_stop {
+    STOP_STEP,                         // Count reached
+    STOP_BREAK,                        // PC is on a breakpoint
+    STOP_WATCH,                        // The last instruction wrote a watched range
+    STOP_HALT,                         // Machine stopped (HALT, MCR, replay end)
+    STOP_START                         // Oldest checkpoint reached going back
+};
+
+// Store that triggered STOP_WATCH
+struct dbg_hit {
+    uint16_t pc, address, old, val;
+};
+
+struct lc3_debugger;
+
+struct lc3_debugger *debugger_create(struct lc3_vm *vm);
+void debugger_destroy(struct lc3_debugger *d);
+void debugger_break(struct lc3_debugger *d, uint16_t address, bool on);
+bool debugger_watch(struct lc3_debugger *d, uint16_t lo, uint16_t hi);
+void debugger_unwatch(struct lc3_debugger *d, uint16_t lo, uint16_t hi);
+void debugger_forget(struct lc3_debugger *d);
+enum dbg_stop debugger_step(struct lc3_debugger *d, uint64_t n);
+enum dbg_stop debugger_continue(struct lc3_debugger *d);
+enum dbg_stop debugger_back(struct lc3_debugger *d, uint64_t n);
+enum dbg_stop debugger_reverse_continue(struct lc3_debugger *d);
+const struct dbg_hit *debugger_hit(const struct lc3_debugger *d);
+void debugger_store(struct lc3_debugger *d, uint16_t address, uint16_t val);
+void debugger_main(struct lc3_debugger *d);
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "vm_gdb.h"
+#include "vm_debugger.h"
+
+#define PKT_SIZE 4096                  // Largest packet payload, as told in qSupported
+
+struct gdb {
+    int fd;
+    bool noack;                        // QStartNoAckMode: no +/- after packets
+    struct lc3_vm *vm;
+    struct lc3_debugger *d;
+    enum dbg_stop last;
+    bool detached;                     // D: the program runs on without us
+
+    uint8_t in[PKT_SIZE];              // Received bytes not read yet
+    size_t len, pos;
+    char frame[PKT_SIZE + 8];          // $payload#cc
+};
+
+// Next received byte, left in place; -1 once the connection is gone
+static int gdb_peek(struct gdb *g) {
+    if (g->pos == g->len) {
+        ssize_t n;
+        do {
+            n = read(g->fd, g->in, sizeof(g->in));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        g->len = n;
+        g->pos = 0;
+    }
+    return g->in[g->pos];
+}
+
+static int gdb_getc(struct gdb *g) {
+    int c = gdb_peek(g);
+    if (c >= 0) g->pos++;
+    return c;
+}
+
+static bool gdb_write(struct gdb *g, const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(g->fd, s, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        s += w;
+        n -= w;
+    }
+    return true;
+}
+
+static int hexval(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static uint32_t parse_hex(const char **p) {
+    uint32_t v = 0;
+    int h;
+    while ((h = hexval(**p)) >= 0) {
+        v = v << 4 | h;
+        (*p)++;
+    }
+    return v;
+}
+
+// Next $payload#cc with a good checksum; false once the connection is gone
+static bool get_packet(struct gdb *g, char *buf, size_t size) {
+    for (;;) {
+        int c;
+        while ((c = gdb_getc(g)) != '$') {
+            if (c < 0) return false;   // Acks and stray Ctrl-C are dropped here
+        }
+        size_t n = 0;
+        uint8_t sum = 0;
+        while ((c = gdb_getc(g)) != '#') {
+            if (c < 0) return false;
+            sum += c;
+            if (n + 1 < size) buf[n++] = c;
+        }
+        buf[n] = 0;
+        int hi = hexval(gdb_getc(g)), lo = hexval(gdb_getc(g));
+        if (g->noack) return true;
+        if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum) {
+            return gdb_write(g, "+", 1);
+        }
+        if (!gdb_write(g, "-", 1)) return false;
+    }
+}
+
+static bool put_packet(struct gdb *g, const char *s) {
+    size_t n = strlen(s);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += (uint8_t)s[i];
+    n = snprintf(g->frame, sizeof(g->frame), "$%s#%02x", s, sum);
+    for (;;) {
+        if (!gdb_write(g, g->frame, n)) return false;
+        if (g->noack) return true;
+        int c = gdb_getc(g);
+        if (c == '+') return true;
+        if (c < 0) return false;
+    }
+}
+
+// Ctrl-C from the client while the machine runs. Stray acks are skipped,
+// as get_packet() would; a packet stays queued for it.
+static bool interrupted(struct gdb *g) {
+    struct pollfd p = { .fd = g->fd, .events = POLLIN };
+    for (;;) {
+        if (g->pos == g->len && poll(&p, 1, 0) <= 0) {
+            return false;
+        }
+        int c = gdb_peek(g);
+        if (c == '+' || c == '-') {
+            g->pos++;
+            continue;
+        }
+        if (c == 0x03) g->pos++;
+        return c == 0x03 || c < 0;
+    }
+}
+
+static uint16_t reg_get(struct lc3_vm *vm, int r) {
+    return r == GDB_NREGS - 1 ? vm->sys.psr | vm->reg[RCND] : vm->reg[r];
+}
+
+static void reg_set(struct lc3_vm *vm, int r, uint16_t v) {
+    if (r == GDB_NREGS - 1) {
+        vm->sys.psr = v & (PSR_USER | 0x0700);
+        vm->reg[RCND] = v & 7;
+    } else {
+        vm->reg[r] = v;
+    }
+}
+
+static void stop_reply(struct gdb *g, char *out) {
+    switch (g->last) {
+        case STOP_WATCH: sprintf(out, "T05watch:%x;", debugger_hit(g->d)->address); break;
+        case STOP_BREAK: strcpy(out, "T05swbreak:;"); break;
+        case STOP_HALT: strcpy(out, "W00"); break;
+        case STOP_START: strcpy(out, "T05replaylog:begin;"); break;
+        default: strcpy(out, "S05"); break;
+    }
+}
+
+// c/s with an address resume there; the history is restarted then
+static void resume_at(struct gdb *g, const char *p) {
+    if (*p) {
+        g->vm->reg[RPC] = parse_hex(&p);
+        debugger_forget(g->d);
+    }
+}
+
+// Answer one packet into out; false ends the session
+static bool handle(struct gdb *g, const char *p, char *out) {
+    struct lc3_vm *vm = g->vm;
+    char op = *p++;
+    out[0] = 0;
+
+    switch (op) {
+        case '?':
+            stop_reply(g, out);
+            break;
+        case 'g':
+            for (int r = 0; r < GDB_NREGS; r++) {
+                sprintf(out + 4 * r, "%04x", reg_get(vm, r));
+            }
+            break;
+        case 'G':
+            for (int r = 0; r < GDB_NREGS && strlen(p) >= 4; r++, p += 4) {
+                char word[5] = { p[0], p[1], p[2], p[3], 0 };
+                const char *w = word;
+                reg_set(vm, r, parse_hex(&w));
+            }
+            debugger_forget(g->d);
+            strcpy(out, "OK");
+            break;
+        case 'p': {
+            uint32_t r = parse_hex(&p);
+            if (r < GDB_NREGS) sprintf(out, "%04x", reg_get(vm, r));
+            else strcpy(out, "E01");
+            break;
+        }
+        case 'P': {
+            uint32_t r = parse_hex(&p);
+            if (r >= GDB_NREGS || *p++ != '=') {
+                strcpy(out, "E01");
+                break;
+            }
+            reg_set(vm, r, parse_hex(&p));
+            debugger_forget(g->d);
+            strcpy(out, "OK");
+            break;
+        }
+        case 'm': {
+            uint32_t a = parse_hex(&p);
+            uint32_t n = *p == ',' ? (p++, parse_hex(&p)) : 0;
+            if (n > PKT_SIZE / 2) n = PKT_SIZE / 2;
+            for (uint32_t k = 0; k < n; k++) {
+                uint16_t w = vm->mem[(uint16_t)(a + k / 2)];
+                sprintf(out + 2 * k, "%02x", k & 1 ? w & 0xFF : w >> 8);
+            }
+            break;
+        }
+        case 'M': {
+            uint32_t a = parse_hex(&p);
+            uint32_t n = *p == ',' ? (p++, parse_hex(&p)) : 0;
+            if (*p++ != ':') {
+                strcpy(out, "E01");
+                break;
+            }
+            for (uint32_t k = 0; k < n && hexval(p[0]) >= 0 && hexval(p[1]) >= 0; k++, p += 2) {
+                uint16_t addr = a + k / 2;
+                uint8_t b = hexval(p[0]) << 4 | hexval(p[1]);
+                vm->mem[addr] = k & 1 ? (vm->mem[addr] & 0xFF00) | b : (vm->mem[addr] & 0x00FF) | b << 8;
+                vm_touch(vm, addr);
+            }
+            debugger_forget(g->d);
+            strcpy(out, "OK");
+            break;
+        }
+        case 'c':
+            resume_at(g, p);
+            for (;;) {
+                g->last = debugger_step(g->d, GDB_CHUNK);
+                if (g->last != STOP_STEP) {
+                    stop_reply(g, out);
+                    break;
+                }
+                if (interrupted(g)) {
+                    strcpy(out, "S02");
+                    break;
+                }
+            }
+            break;
+        case 's':
+            resume_at(g, p);
+            g->last = debugger_step(g->d, 1);
+            stop_reply(g, out);
+            break;
+        case 'b':
+            if (*p == 'c') {
+                g->last = debugger_reverse_continue(g->d);
+            } else if (*p == 's') {
+                g->last = debugger_back(g->d, 1);
+            } else {
+                break;
+            }
+            stop_reply(g, out);
+            break;
+        case 'Z':
+        case 'z': {
+            char type = *p++;
+            if (*p++ != ',') break;
+            uint32_t a = parse_hex(&p);
+            uint32_t n = *p == ',' ? (p++, parse_hex(&p)) : 2;
+            uint16_t hi = a + (n > 1 ? (n + 1) / 2 - 1 : 0);
+            if (type == '0' || type == '1') {
+                debugger_break(g->d, a, op == 'Z');
+                strcpy(out, "OK");
+            } else if (type == '2') {
+                if (op == 'z') debugger_unwatch(g->d, a, hi);
+                strcpy(out, op == 'z' || debugger_watch(g->d, a, hi) ? "OK" : "E01");
+            }
+            break;
+        }
+        case 'q':
+            if (strncmp(p, "Supported", 9) == 0) {
+                sprintf(out, "PacketSize=%x;QStartNoAckMode+;swbreak+;ReverseStep+;ReverseContinue+", PKT_SIZE);
+            } else if (strcmp(p, "Attached") == 0) {
+                strcpy(out, "1");
+            } else if (strcmp(p, "C") == 0) {
+                strcpy(out, "QC1");
+            } else if (strcmp(p, "fThreadInfo") == 0) {
+                strcpy(out, "m1");
+            } else if (strcmp(p, "sThreadInfo") == 0) {
+                strcpy(out, "l");
+            }
+            break;
+        case 'Q':
+            if (strcmp(p, "StartNoAckMode") == 0) {
+                put_packet(g, "OK");
+                g->noack = true;
+                return true;
+            }
+            break;
+        case 'H':
+        case 'T':
+            strcpy(out, "OK");
+            break;
+        case 'D':
+            put_packet(g, "OK");
+            g->detached = true;
+            return false;
+        case 'k':
+            return false;
+        default:
+            break;                     // Empty reply: not supported
+    }
+    return put_packet(g, out);
+}
+
+// Listening socket for a port number on 127.0.0.1 or a Unix socket path
+static int gdb_listen(const char *target, bool *tcp) {
+    char *end;
+    long port = strtol(target, &end, 10);
+    int fd;
+    *tcp = *target && *end == 0;
+    if (*tcp) {
+        struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port),
+                                 .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        int one = 1;
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0) goto fail;
+    } else {
+        struct sockaddr_un a = { .sun_family = AF_UNIX };
+        if (strlen(target) >= sizeof(a.sun_path)) return -1;
+        strcpy(a.sun_path, target);
+        unlink(target);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+        if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0) goto fail;
+    }
+    if (listen(fd, 1) == 0) {
+        return fd;
+    }
+fail:
+    close(fd);
+    return -1;
+}
+
+// Wait for one client and serve it until it detaches, kills the target or
+// goes away. The machine starts stopped at its current PC. Returns 1 when
+// the client detached: the debugger is gone and the caller lets the
+// program run on from where it stopped. 0 otherwise, -1 on errors.
+int gdb_serve(struct lc3_vm *vm, const char *target) {
+    struct lc3_debugger *d = vm->dbg ? vm->dbg : debugger_create(vm);
+    if (d == NULL) {
+        fprintf(stderr, "Cannot allocate the debugger\n");
+        return -1;
+    }
+    bool tcp;
+    int lfd = gdb_listen(target, &tcp);
+    if (lfd < 0) {
+        fprintf(stderr, "Cannot listen on %s\n", target);
+        return -1;
+    }
+    fprintf(stderr, "Waiting for GDB on %s\n", target);
+    int fd;
+    do {
+        fd = accept(lfd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    close(lfd);
+    if (!tcp) {
+        unlink(target);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (tcp) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    struct gdb *g = calloc(1, sizeof(*g));
+    char *pkt = malloc(PKT_SIZE + 1), *out = malloc(PKT_SIZE + 1);
+    if (g && pkt && out) {
+        g->fd = fd;
+        g->vm = vm;
+        g->d = d;
+        g->last = STOP_STEP;
+        while (get_packet(g, pkt, PKT_SIZE + 1) && handle(g, pkt, out));
+    }
+    int rc = g && g->detached;
+    if (rc) {
+        debugger_destroy(d);
+    }
+    close(fd);
+    free(g);
+    free(pkt);
+    free(out);
+    return rc;
+}
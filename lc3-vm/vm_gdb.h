@@ -0,0 +1,18 @@
+#ifndef VM_GDB_H
+#define VM_GDB_H
+
+#include "vm.h"
+
+// GDB remote serial protocol stub on a local socket, on top of the
+// debugger backend (vm_debugger.h). The target is a TCP port on
+// 127.0.0.1 when it is a number, else the path of a Unix socket.
+//
+// LC-3 memory is word addressed: addresses in packets are word addresses,
+// lengths count bytes (two per word). Words and registers are sent big-
+// endian, as in object files. Registers: R0-R7, PC, PSR (with NZP).
+#define GDB_NREGS 10
+#define GDB_CHUNK (1 << 16)            // Instructions between checks for Ctrl-C
+
+int gdb_serve(struct lc3_vm *vm, const char *target);
+
+#endif
@@ -0,0 +1,332 @@
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "vm_io.h"
+
+void io_init(struct lc3_io *io) {
+    atomic_init(&io->out_head, 0);
+    atomic_init(&io->out_tail, 0);
+    pthread_mutex_init(&io->out_lock, NULL);
+    pthread_mutex_init(&io->out_timer_lock, NULL);
+    pthread_cond_init(&io->out_cond, NULL);
+    io->out_fd = -1;
+    io->cap = NULL;
+    io->cap_len = io->cap_size = 0;
+    io->capture = false;
+    io->out_thread_running = false;
+    io->out_stop = false;
+    io->out_flush_ms = 0;
+
+    atomic_init(&io->kbd_head, 0);
+    atomic_init(&io->kbd_tail, 0);
+    atomic_init(&io->kbd_eof, true);
+    io->kbd_direct = true;
+    pthread_mutex_init(&io->kbd_lock, NULL);
+    pthread_cond_init(&io->kbd_wait, NULL);
+    io->kbd_fd = -1;
+    io->kbd_thread_running = false;
+    io->kbd_wake[0] = io->kbd_wake[1] = -1;
+    atomic_init(&io->kbd_stop, false);
+}
+
+static void kbd_close(struct lc3_io *io);
+
+void io_destroy(struct lc3_io *io) {
+    kbd_close(io);
+    out_close(io);
+    free(io->cap);
+    pthread_mutex_destroy(&io->out_lock);
+    pthread_mutex_destroy(&io->out_timer_lock);
+    pthread_cond_destroy(&io->out_cond);
+    pthread_mutex_destroy(&io->kbd_lock);
+    pthread_cond_destroy(&io->kbd_wait);
+}
+
+// Grow the capture buffer and append, -1 when memory runs out
+static ssize_t cap_append(struct lc3_io *io, const char *p, size_t n) {
+    if (io->cap_len + n > io->cap_size) {
+        size_t size = io->cap_size ? io->cap_size : OUT_RING_SIZE;
+        while (size < io->cap_len + n) size *= 2;
+        char *cap = realloc(io->cap, size);
+        if (cap == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        io->cap = cap;
+        io->cap_size = size;
+    }
+    memcpy(io->cap + io->cap_len, p, n);
+    io->cap_len += n;
+    return n;
+}
+
+void out_flush(struct lc3_io *io) {
+    if (atomic_load_explicit(&io->out_head, memory_order_acquire) ==
+        atomic_load_explicit(&io->out_tail, memory_order_relaxed)) {
+        return;
+    }
+
+    pthread_mutex_lock(&io->out_lock);
+    size_t t = atomic_load_explicit(&io->out_tail, memory_order_relaxed);
+    size_t h = atomic_load_explicit(&io->out_head, memory_order_acquire);
+    while (t != h) {
+        size_t off = t & (OUT_RING_SIZE - 1);
+        size_t n = h - t;
+        if (n > OUT_RING_SIZE - off) n = OUT_RING_SIZE - off;
+
+        ssize_t w = io->capture ? cap_append(io, io->out_ring + off, n) :
+                    io->out_fd < 0 ? (ssize_t)n : write(io->out_fd, io->out_ring + off, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            t = h;                     // Output is gone, drop it
+            break;
+        }
+        t += w;
+    }
+    atomic_store_explicit(&io->out_tail, t, memory_order_release);
+    pthread_mutex_unlock(&io->out_lock);
+}
+
+void out_putc(struct lc3_io *io, char c) {
+    size_t h = atomic_load_explicit(&io->out_head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&io->out_tail, memory_order_acquire) == OUT_RING_SIZE) {
+        out_flush(io);
+    }
+    io->out_ring[h & (OUT_RING_SIZE - 1)] = c;
+    atomic_store_explicit(&io->out_head, h + 1, memory_order_release);
+}
+
+void out_write(struct lc3_io *io, const char *s, size_t n) {
+    while (n--) {
+        out_putc(io, *s++);
+    }
+}
+
+// Timer thread: drain whatever is pending every out_flush_ms
+static void *out_timer(void *arg) {
+    struct lc3_io *io = arg;
+
+    pthread_mutex_lock(&io->out_timer_lock);
+    while (!io->out_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)(io->out_flush_ms % 1000) * 1000000L;
+        ts.tv_sec += io->out_flush_ms / 1000 + ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&io->out_cond, &io->out_timer_lock, &ts);
+        out_flush(io);
+    }
+    pthread_mutex_unlock(&io->out_timer_lock);
+    return NULL;
+}
+
+void out_init(struct lc3_io *io, int fd, unsigned flush_ms) {
+    io->out_fd = fd;
+    io->capture = false;
+    io->out_flush_ms = flush_ms;
+    io->out_stop = false;
+    if (flush_ms > 0 && pthread_create(&io->out_thread, NULL, out_timer, io) == 0) {
+        io->out_thread_running = true;
+    }
+}
+
+// Collect output in io->cap instead of writing it anywhere; starts empty
+void out_capture(struct lc3_io *io) {
+    io->capture = true;
+    io->cap_len = 0;
+}
+
+void out_close(struct lc3_io *io) {
+    if (io->out_thread_running) {
+        pthread_mutex_lock(&io->out_timer_lock);
+        io->out_stop = true;
+        pthread_cond_signal(&io->out_cond);
+        pthread_mutex_unlock(&io->out_timer_lock);
+        pthread_join(io->out_thread, NULL);
+        io->out_thread_running = false;
+    }
+    out_flush(io);
+}
+
+// Reader thread: waits on kbd_fd and the wake pipe, so kbd_close() can
+// stop it while it is blocked
+static void *kbd_reader(void *arg) {
+    struct lc3_io *io = arg;
+    unsigned char buf[256];
+
+    for (;;) {
+        struct pollfd p[2] = { { .fd = io->kbd_fd, .events = POLLIN },
+                               { .fd = io->kbd_wake[0], .events = POLLIN } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (p[1].revents) break;
+
+        ssize_t n = read(io->kbd_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (ssize_t k = 0; k < n; k++) {
+            size_t h = atomic_load_explicit(&io->kbd_head, memory_order_relaxed);
+            while (h - atomic_load_explicit(&io->kbd_tail, memory_order_acquire) == KBD_QUEUE_SIZE) {
+                if (atomic_load(&io->kbd_stop)) goto done;
+                struct timespec ts = { 0, 1000000L };
+                nanosleep(&ts, NULL);  // Full, the VM is not reading
+            }
+            io->kbd_q[h & (KBD_QUEUE_SIZE - 1)] = buf[k];
+            atomic_store_explicit(&io->kbd_head, h + 1, memory_order_release);
+        }
+
+        pthread_mutex_lock(&io->kbd_lock);
+        pthread_cond_signal(&io->kbd_wait);
+        pthread_mutex_unlock(&io->kbd_lock);
+    }
+
+done:
+    pthread_mutex_lock(&io->kbd_lock);
+    atomic_store(&io->kbd_eof, true);
+    pthread_cond_signal(&io->kbd_wait);
+    pthread_mutex_unlock(&io->kbd_lock);
+    return NULL;
+}
+
+// Input from fd; a negative fd means no input at all. Without a reader
+// thread the queue is refilled with read() when it runs dry: GETC and IN
+// block for it, a KBSR poll first checks with poll() and reads only what is
+// already there. That suits files and pipes but not an interactive terminal.
+void kbd_init(struct lc3_io *io, int fd, bool reader_thread) {
+    kbd_close(io);
+    atomic_store(&io->kbd_head, 0);
+    atomic_store(&io->kbd_tail, 0);
+    atomic_store(&io->kbd_eof, fd < 0);
+    io->kbd_fd = fd;
+    io->kbd_direct = !reader_thread;
+
+    if (fd >= 0 && reader_thread) {
+        atomic_store(&io->kbd_stop, false);
+        if (pipe(io->kbd_wake) == 0 && pthread_create(&io->kbd_thread, NULL, kbd_reader, io) == 0) {
+            io->kbd_thread_running = true;
+        } else {
+            kbd_close(io);
+            atomic_store(&io->kbd_eof, true);
+        }
+    }
+}
+
+// Stop and join the reader thread, so nothing touches the queue after
+// io_destroy(). The input fd itself belongs to the caller.
+static void kbd_close(struct lc3_io *io) {
+    if (io->kbd_thread_running) {
+        atomic_store(&io->kbd_stop, true);
+        while (write(io->kbd_wake[1], "", 1) < 0 && errno == EINTR) {}
+        pthread_join(io->kbd_thread, NULL);
+        io->kbd_thread_running = false;
+    }
+    for (int k = 0; k < 2; k++) {
+        if (io->kbd_wake[k] >= 0) {
+            close(io->kbd_wake[k]);
+            io->kbd_wake[k] = -1;
+        }
+    }
+}
+
+// Direct mode: read as much as fits in the free part of the queue
+static void kbd_fill(struct lc3_io *io) {
+    size_t h = atomic_load_explicit(&io->kbd_head, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&io->kbd_tail, memory_order_relaxed);
+    size_t off = h & (KBD_QUEUE_SIZE - 1);
+    size_t room = KBD_QUEUE_SIZE - (h - t);
+    if (room > KBD_QUEUE_SIZE - off) room = KBD_QUEUE_SIZE - off;
+
+    ssize_t n;
+    do {
+        n = read(io->kbd_fd, io->kbd_q + off, room);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        atomic_store(&io->kbd_eof, true);
+    } else {
+        atomic_store_explicit(&io->kbd_head, h + n, memory_order_release);
+    }
+}
+
+// Direct mode: true if a read() would not block (data, EOF or an error)
+static bool kbd_ready(struct lc3_io *io) {
+    struct pollfd p = { .fd = io->kbd_fd, .events = POLLIN };
+    return poll(&p, 1, 0) > 0;
+}
+
+// Next byte without removing it, KBD_NONE if the queue is empty. In direct
+// mode an empty queue is refilled; only a waiting caller blocks for it.
+static int kbd_front(struct lc3_io *io, bool wait) {
+    size_t t = atomic_load_explicit(&io->kbd_tail, memory_order_relaxed);
+    if (t == atomic_load_explicit(&io->kbd_head, memory_order_acquire)) {
+        if (io->kbd_direct && !atomic_load(&io->kbd_eof) && (wait || kbd_ready(io))) {
+            kbd_fill(io);
+        }
+        if (t == atomic_load_explicit(&io->kbd_head, memory_order_acquire)) {
+            return atomic_load(&io->kbd_eof) && t == atomic_load(&io->kbd_head) ? KBD_EOF : KBD_NONE;
+        }
+    }
+    return io->kbd_q[t & (KBD_QUEUE_SIZE - 1)];
+}
+
+static void kbd_pop(struct lc3_io *io) {
+    atomic_store_explicit(&io->kbd_tail, atomic_load_explicit(&io->kbd_tail, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// Non-blocking read for KBSR: a byte, KBD_EOF, or KBD_NONE
+int kbd_poll(struct lc3_io *io) {
+    int c = kbd_front(io, false);
+    if (c >= 0) kbd_pop(io);
+    return c;
+}
+
+// Blocking peek, KBD_EOF once input is exhausted
+int kbd_peekc(struct lc3_io *io) {
+    int c = kbd_front(io, true);
+    if (c != KBD_NONE) return c;
+
+    pthread_mutex_lock(&io->kbd_lock);
+    while ((c = kbd_front(io, true)) == KBD_NONE) {
+        pthread_cond_wait(&io->kbd_wait, &io->kbd_lock);
+    }
+    pthread_mutex_unlock(&io->kbd_lock);
+    return c;
+}
+
+// Blocking read with getchar() semantics
+int kbd_getc(struct lc3_io *io) {
+    int c = kbd_peekc(io);
+    if (c >= 0) kbd_pop(io);
+    return c;
+}
+
+// fscanf("%hu") on the queue, *v is untouched when no number follows
+bool kbd_read_u16(struct lc3_io *io, uint16_t *v) {
+    int c;
+    while ((c = kbd_peekc(io)) >= 0 && isspace(c)) kbd_pop(io);
+
+    bool neg = false;
+    if (c == '-' || c == '+') {
+        neg = c == '-';
+        kbd_pop(io);
+        c = kbd_peekc(io);
+    }
+    if (c < 0 || !isdigit(c)) return false;
+
+    uint16_t n = 0;
+    while ((c = kbd_peekc(io)) >= 0 && isdigit(c)) {
+        n = n * 10 + (c - '0');
+        kbd_pop(io);
+    }
+    *v = neg ? -n : n;
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef VM_IO_H
+#define VM_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Console output ring, drained by out_flush() and by a timer thread
+#define OUT_RING_SIZE (1 << 16)        // Bytes, power of two
+#define OUT_FLUSH_MS 100               // Default timer period, 0 disables it
+
+// Keyboard queue, filled by a reader thread so polling never makes a syscall
+#define KBD_QUEUE_SIZE (1 << 12)       // Bytes, power of two
+#define KBD_NONE (-2)                  // kbd_poll(): nothing typed yet
+#define KBD_EOF (-1)                   // Input is exhausted, same as getchar()
+
+// Console streams of one VM
+struct lc3_io {
+    // Output ring: the VM thread is the only producer, out_flush() callers
+    // (VM thread and timer thread) take out_lock to consume.
+    char out_ring[OUT_RING_SIZE];
+    _Atomic size_t out_head, out_tail;
+    pthread_mutex_t out_lock;
+    int out_fd;
+    char *cap;                         // Captured output (out_capture), else NULL
+    size_t cap_len, cap_size;
+    bool capture;
+
+    pthread_t out_thread;
+    pthread_mutex_t out_timer_lock;
+    pthread_cond_t out_cond;
+    bool out_thread_running;
+    bool out_stop;
+    unsigned out_flush_ms;
+
+    // Keyboard queue: the reader thread is the only producer, the VM thread
+    // the only consumer. In direct mode there is no reader thread and the
+    // VM thread refills the queue from kbd_fd itself when it runs dry; a
+    // KBSR poll on an empty queue then costs one poll() that never blocks.
+    unsigned char kbd_q[KBD_QUEUE_SIZE];
+    _Atomic size_t kbd_head, kbd_tail;
+    atomic_bool kbd_eof;
+    bool kbd_direct;
+    pthread_mutex_t kbd_lock;
+    pthread_cond_t kbd_wait;
+    int kbd_fd;
+
+    pthread_t kbd_thread;
+    bool kbd_thread_running;
+    int kbd_wake[2];                   // Self-pipe, a byte stops the reader thread
+    atomic_bool kbd_stop;
+};
+
+void io_init(struct lc3_io *io);
+void io_destroy(struct lc3_io *io);
+
+void out_init(struct lc3_io *io, int fd, unsigned flush_ms);
+void out_putc(struct lc3_io *io, char c);
+void out_write(struct lc3_io *io, const char *s, size_t n);
+void out_flush(struct lc3_io *io);
+void out_close(struct lc3_io *io);
+void out_capture(struct lc3_io *io);
+
+void kbd_init(struct lc3_io *io, int fd, bool reader_thread);
+int kbd_poll(struct lc3_io *io);
+int kbd_getc(struct lc3_io *io);
+int kbd_peekc(struct lc3_io *io);
+bool kbd_read_u16(struct lc3_io *io, uint16_t *v);
+
+#endif
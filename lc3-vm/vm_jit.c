@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "vm_jit.h"
+
+// Basic-block JIT from LC-3 to x86-64.
+//
+// Blocks start at PC_START and at targets of br/jsr/jmp once they have been
+// reached JIT_HOT times. LC-3 registers stay in reg[]; while a block runs
+//   rbx = reg, r12 = mem, r13 = code_map, r14 = entry, r15 = dirty page bitmap.
+// Blocks end in an exit that stores the next PC and jumps to exit_chain; once
+// the target is compiled that jump is patched to go straight to it. Anything
+// the generated code does not handle (traps, RTI, I/O addresses, protected
+// or self-modifying stores) leaves through exit_side before touching state,
+// and the interpreter executes that one instruction.
+//
+// Every VM owns its JIT, so machines on different threads never share code.
+
+#define JIT_CODE_SIZE (16 << 20)       // Executable buffer size
+#define JIT_BLOCK_MAX 64               // Instructions per block
+#define JIT_INST_BYTES 128             // Upper bound on code per instruction
+#define JIT_MAX_BLOCKS 32768
+#define JIT_MAX_LINKS (2 * JIT_MAX_BLOCKS)
+#define JIT_HOT 16                     // Visits before a leader is compiled
+#define JIT_NEVER 0xFFFF               // Leader that cannot be compiled
+
+#if defined(__x86_64__)
+
+typedef struct jit_block {
+    uint16_t start, end;               // LC-3 range [start, end)
+    uint8_t *code, *code_end;          // Host code range
+} jit_block;
+
+typedef struct jit_link {
+    uint16_t target;                   // LC-3 PC the exit continues at
+    uint8_t *site;                     // rel32 of the exit's jmp
+} jit_link;
+
+struct lc3_jit {
+    uint16_t *mem;                     // Memory of the owning VM
+    uint64_t *dirty;                   // Its dirty page bitmap, marked on every store
+    uint8_t *buf;                      // Executable buffer
+    uint8_t *p;                        // Emit cursor
+    uint8_t *exit_chain, *exit_side, *blocks_base;
+    int (*tramp)(void *code, uint16_t *reg, uint16_t *mem);
+
+    uint8_t code_map[UINT16_MAX+1];    // Nonzero where a block covers the address
+    void *entry[UINT16_MAX+1];         // Compiled code per block start
+    uint16_t hits[UINT16_MAX+1];       // Leader visit counts
+    jit_block blocks[JIT_MAX_BLOCKS];
+    int nblocks;
+    jit_link links[JIT_MAX_LINKS];
+    int nlinks;
+
+    // Pending side exits of the block being compiled
+    struct { uint8_t *site; uint16_t pc; } sides[JIT_BLOCK_MAX * 4];
+    int nsides;
+};
+
+// Raw emitters
+static inline void e8(struct lc3_jit *j, uint8_t b)   { *j->p++ = b; }
+static inline void e16(struct lc3_jit *j, uint16_t v) { memcpy(j->p, &v, 2); j->p += 2; }
+static inline void e32(struct lc3_jit *j, uint32_t v) { memcpy(j->p, &v, 4); j->p += 4; }
+static inline void e64(struct lc3_jit *j, uint64_t v) { memcpy(j->p, &v, 8); j->p += 8; }
+static inline void patch32(uint8_t *site, uint8_t *to) { int32_t rel = to - (site + 4); memcpy(site, &rel, 4); }
+
+#define RDISP(r) ((uint8_t)((r) * 2))  // Offset of reg[r] from rbx
+
+// movzx eax/ecx, word [rbx+r*2]
+static void ld_eax(struct lc3_jit *j, int r) { e8(j, 0x0F); e8(j, 0xB7); e8(j, 0x43); e8(j, RDISP(r)); }
+static void ld_ecx(struct lc3_jit *j, int r) { e8(j, 0x0F); e8(j, 0xB7); e8(j, 0x4B); e8(j, RDISP(r)); }
+// mov word [rbx+r*2], ax / imm16
+static void st_ax(struct lc3_jit *j, int r) { e8(j, 0x66); e8(j, 0x89); e8(j, 0x43); e8(j, RDISP(r)); }
+static void st_imm(struct lc3_jit *j, int r, uint16_t v) { e8(j, 0x66); e8(j, 0xC7); e8(j, 0x43); e8(j, RDISP(r)); e16(j, v); }
+// movzx eax, word [r12+a*2]
+static void ld_mem_static(struct lc3_jit *j, uint16_t a) { e8(j, 0x41); e8(j, 0x0F); e8(j, 0xB7); e8(j, 0x84); e8(j, 0x24); e32(j, a * 2u); }
+// movzx eax, word [r12+rax*2]
+static void ld_mem_dyn(struct lc3_jit *j) { e8(j, 0x41); e8(j, 0x0F); e8(j, 0xB7); e8(j, 0x04); e8(j, 0x44); }
+// mov word [r12+a*2], cx
+static void st_mem_static(struct lc3_jit *j, uint16_t a) { e8(j, 0x66); e8(j, 0x41); e8(j, 0x89); e8(j, 0x8C); e8(j, 0x24); e32(j, a * 2u); }
+// mov word [r12+rax*2], cx
+static void st_mem_dyn(struct lc3_jit *j) { e8(j, 0x66); e8(j, 0x41); e8(j, 0x89); e8(j, 0x0C); e8(j, 0x44); }
+// Mark the page of a store dirty: or byte [r15+(a>>9)], 1<<((a>>6)&7)
+static void dirty_static(struct lc3_jit *j, uint16_t a) {
+    e8(j, 0x41); e8(j, 0x80); e8(j, 0x8F); e32(j, a >> 9); e8(j, 1 << ((a >> 6) & 7));
+}
+// Same for the address in eax
+static void dirty_dyn(struct lc3_jit *j) {
+    e8(j, 0x89); e8(j, 0xC2);                                // mov edx, eax
+    e8(j, 0xC1); e8(j, 0xEA); e8(j, 0x06);                   // shr edx, 6
+    e8(j, 0x89); e8(j, 0xD6);                                // mov esi, edx
+    e8(j, 0xC1); e8(j, 0xEE); e8(j, 0x06);                   // shr esi, 6
+    e8(j, 0x49); e8(j, 0x8B); e8(j, 0x3C); e8(j, 0xF7);      // mov rdi, [r15+rsi*8]
+    e8(j, 0x48); e8(j, 0x0F); e8(j, 0xAB); e8(j, 0xD7);      // bts rdi, rdx
+    e8(j, 0x49); e8(j, 0x89); e8(j, 0x3C); e8(j, 0xF7);      // mov [r15+rsi*8], rdi
+}
+// add ax, imm16 ; movzx eax, ax
+static void add_ax_imm(struct lc3_jit *j, uint16_t v) { e8(j, 0x66); e8(j, 0x05); e16(j, v); e8(j, 0x0F); e8(j, 0xB7); e8(j, 0xC0); }
+// cmp eax, imm32
+static void cmp_eax(struct lc3_jit *j, uint32_t v) { e8(j, 0x3D); e32(j, v); }
+// jcc rel32, returns the rel32 site
+static uint8_t *jcc(struct lc3_jit *j, uint8_t cc) { e8(j, 0x0F); e8(j, cc); uint8_t *s = j->p; e32(j, 0); return s; }
+enum { CC_JB = 0x82, CC_JAE = 0x83, CC_JE = 0x84, CC_JNE = 0x85 };
+
+// Condition codes from ax, same rules as uf()
+static void uf_ax(struct lc3_jit *j) {
+    e8(j, 0x66); e8(j, 0x85); e8(j, 0xC0);                   // test ax, ax
+    e8(j, 0xB9); e32(j, FP);                                 // mov ecx, FP
+    e8(j, 0xBA); e32(j, FZ);                                 // mov edx, FZ
+    e8(j, 0x0F); e8(j, 0x44); e8(j, 0xCA);                   // cmovz ecx, edx
+    e8(j, 0xBA); e32(j, FN);                                 // mov edx, FN
+    e8(j, 0x0F); e8(j, 0x48); e8(j, 0xCA);                   // cmovs ecx, edx
+    e8(j, 0x66); e8(j, 0x89); e8(j, 0x4B); e8(j, RDISP(RCND)); // mov [rbx+RCND*2], cx
+}
+
+static uint16_t uf_const(uint16_t v) { return v == 0 ? FZ : (v >> 15) ? FN : FP; }
+
+// Exit to `target`, chained directly once that block exists
+static void link_exit(struct lc3_jit *j, uint16_t target) {
+    st_imm(j, RPC, target);
+    e8(j, 0xE9);
+    uint8_t *site = j->p;
+    e32(j, 0);
+    patch32(site, j->entry[target] ? j->entry[target] : j->exit_chain);
+    if (j->nlinks < JIT_MAX_LINKS) {
+        j->links[j->nlinks++] = (jit_link){ target, site };
+    }
+}
+
+// Exit to the PC in eax, looked up in entry[] at run time
+static void indirect_exit(struct lc3_jit *j) {
+    st_ax(j, RPC);
+    e8(j, 0x49); e8(j, 0x8B); e8(j, 0x14); e8(j, 0xC6);      // mov rdx, [r14+rax*8]
+    e8(j, 0x48); e8(j, 0x85); e8(j, 0xD2);                   // test rdx, rdx
+    patch32(jcc(j, CC_JE), j->exit_chain);
+    e8(j, 0xFF); e8(j, 0xE2);                                // jmp rdx
+}
+
+static void side_exit(struct lc3_jit *j, uint8_t *site, uint16_t pc) {
+    j->sides[j->nsides].site = site;
+    j->sides[j->nsides].pc = pc;
+    j->nsides++;
+}
+
+// Store address in eax: leave for protected, I/O and compiled-code addresses
+static void check_store_dyn(struct lc3_jit *j, uint16_t pc) {
+    if (MEMORY_PROTECTION) {
+        cmp_eax(j, MEM_PROTECTED_END + 1);
+        side_exit(j, jcc(j, CC_JB), pc);
+    }
+    cmp_eax(j, KBSR);
+    side_exit(j, jcc(j, CC_JAE), pc);
+    e8(j, 0x41); e8(j, 0x80); e8(j, 0x7C); e8(j, 0x05); e8(j, 0x00); e8(j, 0x00); // cmp byte [r13+rax], 0
+    side_exit(j, jcc(j, CC_JNE), pc);
+}
+
+// Static addresses the generated code must never load from or store to
+static bool io_load(uint16_t a)  { return a >= KBSR; }
+static bool io_store(uint16_t a) {
+    return a >= KBSR || (MEMORY_PROTECTION && a >= MEM_PROTECTED_START && a <= MEM_PROTECTED_END);
+}
+
+static void jit_flush(struct lc3_jit *j) {
+    j->p = j->blocks_base;
+    memset(j->entry, 0, sizeof(j->entry));
+    memset(j->code_map, 0, sizeof(j->code_map));
+    j->nblocks = 0;
+    j->nlinks = 0;
+}
+
+struct lc3_jit *jit_create(uint16_t *mem, uint64_t *dirty) {
+    struct lc3_jit *j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        return NULL;
+    }
+    void *buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        free(j);
+        return NULL;
+    }
+    j->mem = mem;
+    j->dirty = dirty;
+    j->buf = j->p = buf;
+
+    // int tramp(code, reg, mem)
+    j->tramp = (void *)j->p;
+    e8(j, 0x53); e8(j, 0x55);                                // push rbx, rbp
+    e8(j, 0x41); e8(j, 0x54); e8(j, 0x41); e8(j, 0x55);      // push r12, r13
+    e8(j, 0x41); e8(j, 0x56); e8(j, 0x41); e8(j, 0x57);      // push r14, r15
+    e8(j, 0x48); e8(j, 0x83); e8(j, 0xEC); e8(j, 0x08);      // sub rsp, 8
+    e8(j, 0x48); e8(j, 0x89); e8(j, 0xF3);                   // mov rbx, rsi
+    e8(j, 0x49); e8(j, 0x89); e8(j, 0xD4);                   // mov r12, rdx
+    e8(j, 0x49); e8(j, 0xBD); e64(j, (uintptr_t)j->code_map); // mov r13, code_map
+    e8(j, 0x49); e8(j, 0xBE); e64(j, (uintptr_t)j->entry);   // mov r14, entry
+    e8(j, 0x49); e8(j, 0xBF); e64(j, (uintptr_t)j->dirty);   // mov r15, dirty
+    e8(j, 0xFF); e8(j, 0xE7);                                // jmp rdi
+
+    j->exit_side = j->p;
+    e8(j, 0xB8); e32(j, JIT_EXIT_SIDE);                      // mov eax, JIT_EXIT_SIDE
+    e8(j, 0xEB); e8(j, 0x02);                                // jmp epilogue
+    j->exit_chain = j->p;
+    e8(j, 0x31); e8(j, 0xC0);                                // xor eax, eax
+    e8(j, 0x48); e8(j, 0x83); e8(j, 0xC4); e8(j, 0x08);      // add rsp, 8
+    e8(j, 0x41); e8(j, 0x5F); e8(j, 0x41); e8(j, 0x5E);      // pop r15, r14
+    e8(j, 0x41); e8(j, 0x5D); e8(j, 0x41); e8(j, 0x5C);      // pop r13, r12
+    e8(j, 0x5D); e8(j, 0x5B);                                // pop rbp, rbx
+    e8(j, 0xC3);                                             // ret
+
+    j->blocks_base = j->p;
+    jit_flush(j);
+    return j;
+}
+
+void jit_destroy(struct lc3_jit *j) {
+    if (j) {
+        munmap(j->buf, JIT_CODE_SIZE);
+        free(j);
+    }
+}
+
+// Forget all code and leader counts, memory was replaced wholesale
+void jit_reset(struct lc3_jit *j) {
+    jit_flush(j);
+    memset(j->hits, 0, sizeof(j->hits));
+}
+
+uint8_t *jit_code_map(struct lc3_jit *j) {
+    return j->code_map;
+}
+
+// Compile the block at pc, or return NULL if its first instruction
+// must run in the interpreter
+static void *jit_compile(struct lc3_jit *j, uint16_t start) {
+    if (j->nblocks == JIT_MAX_BLOCKS || j->nlinks > JIT_MAX_LINKS - 2 * JIT_BLOCK_MAX ||
+        j->p + JIT_BLOCK_MAX * JIT_INST_BYTES > j->buf + JIT_CODE_SIZE) {
+        jit_flush(j);
+    }
+
+    uint16_t *mem = j->mem;
+    uint8_t *code = j->p;
+    uint16_t pc = start;
+    bool open = true;                  // No exit emitted yet
+    j->nsides = 0;
+
+    for (int n = 0; n < JIT_BLOCK_MAX && open; n++) {
+        if (pc >= KBSR) break;
+        uint16_t i = mem[pc];
+        uint16_t next = pc + 1;
+
+        switch (OPC(i)) {
+            case 0x1: // ADD
+            case 0x5: // AND
+                ld_eax(j, SR1(i));
+                if (FIMM(i)) {
+                    e8(j, 0x66); e8(j, OPC(i) == 0x1 ? 0x05 : 0x25); e16(j, SEXTIMM(i)); // add/and ax, imm16
+                } else {
+                    ld_ecx(j, SR2(i));
+                    e8(j, 0x66); e8(j, OPC(i) == 0x1 ? 0x01 : 0x21); e8(j, 0xC8);      // add/and ax, cx
+                }
+                st_ax(j, DR(i));
+                uf_ax(j);
+                break;
+            case 0x9: // NOT
+                ld_eax(j, SR1(i));
+                e8(j, 0x66); e8(j, 0xF7); e8(j, 0xD0);       // not ax
+                st_ax(j, DR(i));
+                uf_ax(j);
+                break;
+            case 0xE: { // LEA
+                uint16_t v = next + POFF9(i);
+                st_imm(j, DR(i), v);
+                st_imm(j, RCND, uf_const(v));
+                break;
+            }
+            case 0x2: { // LD
+                uint16_t a = next + POFF9(i);
+                if (io_load(a)) goto done;
+                ld_mem_static(j, a);
+                st_ax(j, DR(i));
+                uf_ax(j);
+                break;
+            }
+            case 0xA: { // LDI
+                uint16_t a = next + POFF9(i);
+                if (io_load(a)) goto done;
+                ld_mem_static(j, a);
+                cmp_eax(j, KBSR);
+                side_exit(j, jcc(j, CC_JAE), pc);
+                ld_mem_dyn(j);
+                st_ax(j, DR(i));
+                uf_ax(j);
+                break;
+            }
+            case 0x6: // LDR
+                ld_eax(j, SR1(i));
+                add_ax_imm(j, POFF(i));
+                cmp_eax(j, KBSR);
+                side_exit(j, jcc(j, CC_JAE), pc);
+                ld_mem_dyn(j);
+                st_ax(j, DR(i));
+                uf_ax(j);
+                break;
+            case 0x3: { // ST
+                uint16_t a = next + POFF9(i);
+                if (io_store(a)) goto done;
+                e8(j, 0x41); e8(j, 0x80); e8(j, 0xBD); e32(j, a); e8(j, 0x00); // cmp byte [r13+a], 0
+                side_exit(j, jcc(j, CC_JNE), pc);
+                ld_ecx(j, DR(i));
+                st_mem_static(j, a);
+                dirty_static(j, a);
+                break;
+            }
+            case 0xB: { // STI
+                uint16_t a = next + POFF9(i);
+                if (io_load(a)) goto done;
+                ld_mem_static(j, a);
+                check_store_dyn(j, pc);
+                ld_ecx(j, DR(i));
+                st_mem_dyn(j);
+                dirty_dyn(j);
+                break;
+            }
+            case 0x7: // STR
+                ld_eax(j, SR1(i));
+                add_ax_imm(j, POFF(i));
+                check_store_dyn(j, pc);
+                ld_ecx(j, DR(i));
+                st_mem_dyn(j);
+                dirty_dyn(j);
+                break;
+            case 0x0: { // BR
+                uint16_t target = next + POFF9(i);
+                if (FCND(i) == 0) break;
+                if (FCND(i) == (FN | FZ | FP)) {
+                    link_exit(j, target);
+                } else {
+                    e8(j, 0x66); e8(j, 0xF7); e8(j, 0x43); e8(j, RDISP(RCND)); e16(j, FCND(i)); // test [rbx+RCND*2], nzp
+                    e8(j, 0x74); e8(j, 11);                                                   // jz fallthrough
+                    link_exit(j, target);
+                    link_exit(j, next);
+                }
+                open = false;
+                break;
+            }
+            case 0x4: // JSR
+                st_imm(j, R7, next);
+                if (FL(i)) {
+                    link_exit(j, next + POFF11(i));
+                } else {
+                    ld_eax(j, BR(i));
+                    indirect_exit(j);
+                }
+                open = false;
+                break;
+            case 0xC: // JMP
+                ld_eax(j, BR(i));
+                indirect_exit(j);
+                open = false;
+                break;
+            default: // RTI, RES, TRAP
+                goto done;
+        }
+        pc = next;
+    }
+done:
+
+    if (pc == start) {
+        j->p = code;
+        return NULL;
+    }
+    if (open) {
+        // Fell off the end, or stopped in front of an instruction we leave alone
+        link_exit(j, pc);
+    }
+
+    // Side exits, sharing one stub per PC
+    uint8_t *stub = NULL;
+    for (int s = 0; s < j->nsides; s++) {
+        if (s == 0 || j->sides[s].pc != j->sides[s - 1].pc) {
+            stub = j->p;
+            st_imm(j, RPC, j->sides[s].pc);
+            e8(j, 0xE9);
+            patch32(j->p, j->exit_side);
+            j->p += 4;
+        }
+        patch32(j->sides[s].site, stub);
+    }
+
+    j->blocks[j->nblocks++] = (jit_block){ start, pc, code, j->p };
+    for (uint32_t a = start; a < pc; a++) {
+        j->code_map[a] = 1;
+    }
+    j->entry[start] = code;
+    for (int l = 0; l < j->nlinks; l++) {
+        if (j->links[l].target == start) {
+            patch32(j->links[l].site, code);
+        }
+    }
+    return code;
+}
+
+void jit_mark_leader(struct lc3_jit *j, uint16_t pc) {
+    if (j->hits[pc] == 0) {
+        j->hits[pc] = 1;
+    }
+}
+
+void *jit_block_for(struct lc3_jit *j, uint16_t pc) {
+    if (j->entry[pc]) {
+        return j->entry[pc];
+    }
+    if (j->hits[pc] == 0 || j->hits[pc] == JIT_NEVER || ++j->hits[pc] < JIT_HOT) {
+        return NULL;
+    }
+    void *code = jit_compile(j, pc);
+    if (code == NULL) {
+        j->hits[pc] = JIT_NEVER;
+    }
+    return code;
+}
+
+int jit_enter(struct lc3_jit *j, void *code, uint16_t *reg) {
+    return j->tramp(code, reg, j->mem);
+}
+
+// A store through mw() hit compiled code: drop every block covering it
+void jit_invalidate(struct lc3_jit *j, uint16_t address) {
+    uint16_t lo = address, hi = address;
+
+    for (int b = 0; b < j->nblocks; ) {
+        jit_block *blk = &j->blocks[b];
+        if (address < blk->start || address >= blk->end) {
+            b++;
+            continue;
+        }
+
+        // Chained jumps into the old code now land on an exit to its start
+        uint8_t *save = j->p;
+        j->p = blk->code;
+        st_imm(j, RPC, blk->start);
+        e8(j, 0xE9);
+        patch32(j->p, j->exit_chain);
+        j->p = save;
+
+        // Forget links whose site lives in the dead code
+        for (int l = 0; l < j->nlinks; ) {
+            if (j->links[l].site >= blk->code && j->links[l].site < blk->code_end) {
+                j->links[l] = j->links[--j->nlinks];
+            } else {
+                l++;
+            }
+        }
+
+        j->entry[blk->start] = NULL;
+        j->hits[blk->start] = 1;
+        if (blk->start < lo) lo = blk->start;
+        if (blk->end - 1 > hi) hi = blk->end - 1;
+        *blk = j->blocks[--j->nblocks];
+    }
+
+    // Rebuild the code map over the range that lost blocks
+    memset(&j->code_map[lo], 0, hi - lo + 1);
+    for (int b = 0; b < j->nblocks; b++) {
+        for (uint32_t a = j->blocks[b].start; a < j->blocks[b].end; a++) {
+            if (a >= lo && a <= hi) j->code_map[a] = 1;
+        }
+    }
+}
+
+#else
+
+struct lc3_jit *jit_create(uint16_t *mem, uint64_t *dirty) {
+    (void)mem;
+    (void)dirty;
+    fprintf(stderr, "JIT is only available on x86-64\n");
+    return NULL;
+}
+void jit_destroy(struct lc3_jit *j) { (void)j; }
+void jit_reset(struct lc3_jit *j) { (void)j; }
+uint8_t *jit_code_map(struct lc3_jit *j) { (void)j; return NULL; }
+void jit_mark_leader(struct lc3_jit *j, uint16_t pc) { (void)j; (void)pc; }
+void *jit_block_for(struct lc3_jit *j, uint16_t pc) { (void)j; (void)pc; return NULL; }
+int jit_enter(struct lc3_jit *j, void *code, uint16_t *reg) { (void)j; (void)code; (void)reg; return JIT_EXIT_SIDE; }
+void jit_invalidate(struct lc3_jit *j, uint16_t address) { (void)j; (void)address; }
+
+#endif
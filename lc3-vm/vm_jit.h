@@ -0,0 +1,24 @@
+#ifndef VM_JIT_H
+#define VM_JIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Why a compiled block handed control back to the interpreter
+enum jit_exit {
+    JIT_EXIT_CHAIN = 0,                // Reached a block boundary, PC starts a block
+    JIT_EXIT_SIDE = 1                  // PC needs the interpreter (trap, I/O, SMC)
+};
+
+struct lc3_jit;
+
+struct lc3_jit *jit_create(uint16_t *mem, uint64_t *dirty);
+void jit_destroy(struct lc3_jit *j);
+void jit_reset(struct lc3_jit *j);
+uint8_t *jit_code_map(struct lc3_jit *j);
+void jit_mark_leader(struct lc3_jit *j, uint16_t pc);
+void *jit_block_for(struct lc3_jit *j, uint16_t pc);
+int jit_enter(struct lc3_jit *j, void *code, uint16_t *reg);
+void jit_invalidate(struct lc3_jit *j, uint16_t address);
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "vm_load.h"
+
+// LC-3 is big endian, only little-endian hosts need to swap
+#if defined(__LITTLE_ENDIAN__) || defined(__LITTLE_ENDIAN) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define HOST_LE 1
+#else
+#define HOST_LE 0
+#endif
+
+static const char *cache_dir;          // Pre-swapped image cache, NULL when off
+
+void ld_cache_dir(const char *dir) {
+    cache_dir = dir;
+}
+
+static void swap16_scalar(uint16_t *dst, const uint8_t *src, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        dst[k] = (uint16_t)(src[2*k] << 8) | src[2*k + 1];
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2")))
+static void swap16_avx2(uint16_t *dst, const uint8_t *src, size_t n) {
+    const __m256i m = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                       1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; n >= 16; n -= 16, src += 32, dst += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_shuffle_epi8(v, m));
+    }
+    swap16_scalar(dst, src, n);
+}
+
+__attribute__((target("ssse3")))
+static void swap16_ssse3(uint16_t *dst, const uint8_t *src, size_t n) {
+    const __m128i m = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; n >= 8; n -= 8, src += 16, dst += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, m));
+    }
+    swap16_scalar(dst, src, n);
+}
+#endif
+
+void swap16(uint16_t *dst, const uint8_t *src, size_t n) {
+#if !HOST_LE
+    memcpy(dst, src, n * sizeof(uint16_t));
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("avx2")) {
+        swap16_avx2(dst, src, n);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        swap16_ssse3(dst, src, n);
+    } else {
+        swap16_scalar(dst, src, n);
+    }
+#else
+    swap16_scalar(dst, src, n);
+#endif
+}
+
+// Read-only mapping of a whole file
+struct mapped {
+    const uint8_t *p;
+    size_t size;
+};
+
+static int map_file(const char *fname, struct mapped *m) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 2) {
+        close(fd);
+        m->p = NULL;
+        m->size = 0;
+        return 0;
+    }
+    m->size = st.st_size;
+    m->p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->p == MAP_FAILED) {
+        m->p = NULL;
+        m->size = 0;
+    }
+    return 0;
+}
+
+static void unmap_file(struct mapped *m) {
+    if (m->p) {
+        munmap((void *)m->p, m->size);
+    }
+}
+
+// Cache entry of a file: named after its device, inode, size and mtime, so
+// a hit costs a stat() and never reads the file itself
+static void cache_path(char *path, size_t size, const struct stat *st) {
+    snprintf(path, size, "%s/%llx-%llx-%llx-%lld.%09ld.img", cache_dir,
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size, (long long)st->st_mtim.tv_sec,
+             (long)st->st_mtim.tv_nsec);
+}
+
+// Swap f into a fresh buffer for the caller to free, and keep a copy in
+// the cache under path (NULL if off)
+static uint16_t *swap_file(const struct mapped *f, const char *path) {
+    size_t n = f->size / 2;
+    uint16_t *buf = malloc(n * 2);
+    if (buf == NULL) {
+        return NULL;
+    }
+    swap16(buf, f->p, n);
+
+    if (path) {
+        // Write under a private name, rename() makes it appear whole
+        char tmp[4096 + 32];
+        snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            bool ok = write(fd, buf, n * 2) == (ssize_t)(n * 2);
+            close(fd);
+            if (!ok || rename(tmp, path) < 0) {
+                unlink(tmp);
+            }
+        }
+    }
+    return buf;
+}
+
+// Words [base, base+n) were loaded: clip n to memory and mark the pages
+static size_t placed(struct lc3_vm *vm, bool has_origin, uint16_t base, size_t n) {
+    size_t max = has_origin ? MEM_WORDS - base : (size_t)(UINT16_MAX - base);
+    if (n > max) n = max;
+    for (size_t a = base & ~(PAGE_WORDS - 1); a < base + n; a += PAGE_WORDS) {
+        vm_touch(vm, a);
+    }
+    return n;
+}
+
+// Cache hit: read the swapped words straight into memory. -1 if the entry
+// is missing or not the expected size
+static long ld_cached(struct lc3_vm *vm, const char *path, size_t bytes, bool has_origin,
+                      uint16_t *base) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != bytes || (has_origin && bytes < 4) ||
+        (has_origin && pread(fd, base, 2, 0) != 2)) {
+        close(fd);
+        return -1;
+    }
+    size_t skip = has_origin ? 2 : 0;
+    size_t n = placed(vm, has_origin, *base, (bytes - skip) / 2);
+    ssize_t got = pread(fd, vm->mem + *base, n * 2, skip);
+    close(fd);
+    return got == (ssize_t)(n * 2) ? (long)n : -1;
+}
+
+// Load the words of fname at base, or at the origin in its first word
+static long ld_file(struct lc3_vm *vm, const char *fname, bool has_origin,
+                    uint16_t base, uint16_t *origin) {
+    struct mapped f;
+    char path[4096];
+    struct stat st;
+
+    // Odd sizes are not cached: the copy would be a byte short of the file
+    bool cached = cache_dir && stat(fname, &st) == 0 && st.st_size % 2 == 0;
+    if (cached) {
+        cache_path(path, sizeof(path), &st);
+        long n = ld_cached(vm, path, st.st_size, has_origin, &base);
+        if (n >= 0) {
+            if (origin) *origin = base;
+            return n;
+        }
+    }
+
+    if (map_file(fname, &f) < 0) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        return -1;
+    }
+    if (f.p == NULL || (has_origin && f.size < 4)) {
+        fprintf(stderr, "Error: Could not read from file %s\n", fname);
+        unmap_file(&f);
+        return -1;
+    }
+    uint16_t *buf = swap_file(&f, cached ? path : NULL);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Could not read from file %s\n", fname);
+        unmap_file(&f);
+        return -1;
+    }
+
+    const uint16_t *w = buf;
+    size_t n = f.size / 2;
+    if (has_origin) {
+        base = *w++;
+        n--;
+    }
+    n = placed(vm, has_origin, base, n);
+    memcpy(vm->mem + base, w, n * sizeof(uint16_t));
+
+    if (origin) *origin = base;
+    free(buf);
+    unmap_file(&f);
+    return n;
+}
+
+// Load program from file, returns the number of words read or -1
+long ld_img(struct lc3_vm *vm, const char *fname, uint16_t offset) {
+    return ld_file(vm, fname, false, vm->pc_start + offset, NULL);
+}
+
+long ld_obj(struct lc3_vm *vm, const char *fname, uint16_t *origin) {
+    return ld_file(vm, fname, true, 0, origin);
+}
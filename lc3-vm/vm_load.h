@@ -0,0 +1,21 @@
+#ifndef VM_LOAD_H
+#define VM_LOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Raw image: big-endian words loaded at pc_start + offset
+long ld_img(struct lc3_vm *vm, const char *fname, uint16_t offset);
+
+// LC-3 object file: the first word is the origin, the rest is loaded there
+long ld_obj(struct lc3_vm *vm, const char *fname, uint16_t *origin);
+
+// Keep byte-swapped copies of loaded files in dir (NULL turns it off)
+void ld_cache_dir(const char *dir);
+
+// Big-endian bytes to host-endian words
+void swap16(uint16_t *dst, const uint8_t *src, size_t n);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm_prof.h"
+#include "vm_dbg.h"
+
+// Rough cycle cost per opcode: one for decode/execute plus one per memory
+// access, traps counted as a call into a service routine
+const uint8_t prof_cycles[NOPS] = {
+    /* BR   */ 1, /* ADD */ 1, /* LD  */ 2, /* ST  */ 2,
+    /* JSR  */ 2, /* AND */ 1, /* LDR */ 2, /* STR */ 2,
+    /* RTI  */ 3, /* NOT */ 1, /* LDI */ 3, /* STI */ 3,
+    /* JMP  */ 1, /* RES */ 1, /* LEA */ 1, /* TRAP */ 10
+};
+
+#define NO_NODE UINT32_MAX
+
+static uint32_t child_hash(uint32_t parent, uint16_t fn, uint32_t hcap) {
+    return ((parent * 0x9E3779B1u) ^ (fn * 0x85EBCA6Bu)) & (hcap - 1);
+}
+
+static uint32_t add_node(struct lc3_prof *p, uint32_t parent, uint16_t fn) {
+    if (p->nnodes == p->cap) {
+        uint32_t cap = p->cap * 2;
+        struct prof_node *n = realloc(p->nodes, cap * sizeof(*n));
+        if (n == NULL) return NO_NODE;
+        p->nodes = n;
+        p->cap = cap;
+    }
+    p->nodes[p->nnodes] = (struct prof_node){ .fn = fn, .parent = parent, .self = 0 };
+    return p->nnodes++;
+}
+
+// Double the child hash; false if there is no memory for it
+static bool rehash(struct lc3_prof *p) {
+    uint32_t hcap = p->hcap * 2;
+    uint32_t *h = malloc(hcap * sizeof(*h));
+    if (h == NULL) return false;
+    memset(h, 0xFF, hcap * sizeof(*h));
+    for (uint32_t k = 1; k < p->nnodes; k++) {
+        uint32_t s = child_hash(p->nodes[k].parent, p->nodes[k].fn, hcap);
+        while (h[s] != NO_NODE) s = (s + 1) & (hcap - 1);
+        h[s] = k;
+    }
+    free(p->children);
+    p->children = h;
+    p->hcap = hcap;
+    return true;
+}
+
+struct lc3_prof *prof_create(uint16_t entry) {
+    struct lc3_prof *p = calloc(1, sizeof(*p));
+    if (p == NULL) return NULL;
+    p->cap = 256;
+    p->hcap = 512;
+    p->nodes = malloc(p->cap * sizeof(*p->nodes));
+    p->children = malloc(p->hcap * sizeof(*p->children));
+    if (p->nodes == NULL || p->children == NULL) {
+        prof_destroy(p);
+        return NULL;
+    }
+    memset(p->children, 0xFF, p->hcap * sizeof(*p->children));
+    add_node(p, NO_NODE, entry);
+    return p;
+}
+
+void prof_destroy(struct lc3_prof *p) {
+    if (p == NULL) return;
+    free(p->nodes);
+    free(p->children);
+    free(p);
+}
+
+// JSR/JSRR to target: descend into (or create) that child frame. A call
+// that cannot descend keeps charging the caller and is counted in
+// overflow, so its RET does not pop a frame that is still running.
+void prof_call(struct lc3_prof *p, uint16_t target) {
+    if (p->overflow || p->depth == PROF_DEPTH) {
+        p->overflow++;                 // Too deep, or inside a call that was
+        return;
+    }
+    uint32_t s = child_hash(p->cur, target, p->hcap);
+    uint32_t n;
+    while ((n = p->children[s]) != NO_NODE) {
+        if (p->nodes[n].parent == p->cur && p->nodes[n].fn == target) break;
+        s = (s + 1) & (p->hcap - 1);
+    }
+    if (n == NO_NODE) {
+        // Without a rehash the table must not fill up, or the probe above
+        // would never find an empty slot
+        if (p->full || (n = add_node(p, p->cur, target)) == NO_NODE) {
+            p->overflow++;
+            return;
+        }
+        p->children[s] = n;
+        if (p->nnodes * 2 > p->hcap && !rehash(p)) p->full = true;
+    }
+    p->cur = n;
+    p->depth++;
+}
+
+// RET (JMP R7): back to the caller's frame
+void prof_ret(struct lc3_prof *p) {
+    if (p->overflow) {
+        p->overflow--;                 // Its call never descended
+    } else if (p->depth > 0) {
+        p->cur = p->nodes[p->cur].parent;
+        p->depth--;
+    }
+}
+
+struct hot {
+    uint64_t count;
+    uint16_t addr;
+};
+
+static int by_count(const void *a, const void *b) {
+    uint64_t x = ((const struct hot *)a)->count, y = ((const struct hot *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Per-opcode table and the `top` most executed addresses, with their
+// labels when the program was assembled here (syms may be NULL)
+void prof_report(FILE *f, const struct lc3_prof *p, const uint16_t *mem, const struct lc3_syms *syms, int top) {
+    uint64_t total = 0;
+    for (int o = 0; o < NOPS; o++) total += p->op[o];
+    double pct = total ? 100.0 / total : 0;
+
+    fprintf(f, "Instructions: %llu, estimated cycles: %llu (CPI %.2f)\n",
+            (unsigned long long)total, (unsigned long long)p->cycles,
+            total ? (double)p->cycles / total : 0.0);
+
+    fprintf(f, "\nopcode        count      %%     cycles\n");
+    for (int o = 0; o < NOPS; o++) {
+        if (p->op[o] == 0) continue;
+        fprintf(f, "%-6s %12llu %6.2f %10llu\n", op_names[o], (unsigned long long)p->op[o],
+                p->op[o] * pct, (unsigned long long)p->op[o] * prof_cycles[o]);
+    }
+
+    // Pairs the cached core would fuse, by how often their first word ran
+    static const char *const fuse_names[NFUSE] = { "", "AND+ADD", "NOT+ADD", "ADD+BR" };
+    uint64_t fused[NFUSE] = { 0 };
+    for (uint32_t a = 0; a + 1 < IO_START; a++) {
+        if (p->pc[a]) fused[fuse_kind(mem[a], mem[a + 1])] += p->pc[a];
+    }
+    if (fused[FUSE_SET] + fused[FUSE_NEG] + fused[FUSE_ADD_BR]) {
+        fprintf(f, "\nfused         count      %%\n");
+        for (int k = FUSE_NONE + 1; k < NFUSE; k++) {
+            fprintf(f, "%-8s %10llu %6.2f\n", fuse_names[k], (unsigned long long)fused[k], fused[k] * pct);
+        }
+    }
+
+    struct hot *hot = malloc(MEM_WORDS * sizeof(struct hot));
+    if (hot == NULL) return;
+    int n = 0;
+    for (uint32_t a = 0; a < MEM_WORDS; a++) {
+        if (p->pc[a]) hot[n++] = (struct hot){ p->pc[a], a };
+    }
+    qsort(hot, n, sizeof(struct hot), by_count);
+
+    fprintf(f, "\naddress       count      %%  instr%s\n", syms ? "        label" : "");
+    for (int k = 0; k < n && k < top; k++) {
+        uint16_t i = mem[hot[k].addr], off;
+        const char *label = sym_at(syms, hot[k].addr, &off);
+        fprintf(f, "0x%04X %12llu %6.2f  0x%04X %-5s", hot[k].addr, (unsigned long long)hot[k].count,
+                hot[k].count * pct, i, op_names[OPC(i)]);
+        if (label && off) fprintf(f, "  %s+%u", label, off);
+        else if (label) fprintf(f, "  %s", label);
+        fputc('\n', f);
+    }
+    free(hot);
+}
+
+static void frame_path(FILE *f, const struct lc3_prof *p, const struct lc3_syms *syms, uint32_t n) {
+    char name[300];
+    if (p->nodes[n].parent != NO_NODE) {
+        frame_path(f, p, syms, p->nodes[n].parent);
+        fputc(';', f);
+    }
+    sym_format(syms, p->nodes[n].fn, name, sizeof(name));
+    fputs(name, f);
+}
+
+// Folded stacks ("a;b;c count" per line) for flamegraph.pl and friends;
+// frames are named by label where there is one
+void prof_folded(FILE *f, const struct lc3_prof *p, const struct lc3_syms *syms) {
+    for (uint32_t n = 0; n < p->nnodes; n++) {
+        if (p->nodes[n].self == 0) continue;
+        frame_path(f, p, syms, n);
+        fprintf(f, " %llu\n", (unsigned long long)p->nodes[n].self);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef VM_PROF_H
+#define VM_PROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "vm_asm.h"
+
+#define PROF_DEPTH 256                 // Deepest JSR nesting tracked
+
+// Node of the call tree: one per distinct call path
+struct prof_node {
+    uint16_t fn;                       // Entry address of the routine
+    uint32_t parent;
+    uint64_t self;                     // Instructions executed in this frame
+};
+
+// Execution counts of one VM, filled while vm->prof is set
+struct lc3_prof {
+    uint64_t pc[MEM_WORDS];            // Executions per address
+    uint64_t op[NOPS];                 // Executions per opcode
+    uint64_t cycles;                   // Estimated cycles, see prof_cycles
+
+    struct prof_node *nodes;           // Call tree, node 0 is the entry frame
+    uint32_t nnodes, cap;
+    uint32_t *children;                // Hash of (parent, fn) -> node index
+    uint32_t hcap;
+    uint32_t cur;                      // Node of the running frame
+    uint32_t depth;
+    uint32_t overflow;                 // Calls not descended into, their RETs pop nothing
+    bool full;                         // A rehash failed, no more nodes are added
+};
+
+extern const uint8_t prof_cycles[NOPS];
+
+struct lc3_prof *prof_create(uint16_t entry);
+void prof_destroy(struct lc3_prof *p);
+void prof_call(struct lc3_prof *p, uint16_t target);
+void prof_ret(struct lc3_prof *p);
+void prof_report(FILE *f, const struct lc3_prof *p, const uint16_t *mem, const struct lc3_syms *syms, int top);
+void prof_folded(FILE *f, const struct lc3_prof *p, const struct lc3_syms *syms);
+
+// Count one instruction, called by the profiling loop before it executes
+static inline void prof_count(struct lc3_prof *p, uint16_t pc, uint16_t i) {
+    p->pc[pc]++;
+    p->op[OPC(i)]++;
+    p->cycles += prof_cycles[OPC(i)];
+    p->nodes[p->cur].self++;
+}
+
+#endif
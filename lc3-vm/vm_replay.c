@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm_replay.h"
+#include "vm_io.h"
+
+struct lc3_replay {
+    bool playing;
+    bool live;                         // Recording once playback reaches the end
+
+    // Recording: events are appended to buf and streamed to f
+    FILE *f;
+    size_t cap;
+    uint64_t idle, idle_at;            // Empty polls not written yet
+
+    // The whole log in memory
+    uint8_t *buf;
+    size_t len, pos;
+    uint64_t n, at;                    // Events so far, icount of the last one
+    uint64_t idle_left;
+    bool failed;
+};
+
+static const char *const ev_names[] = { "?", "KBSR poll", "KBSR poll", "GETC/IN", "INU16" };
+
+static void put_byte(struct lc3_replay *r, uint8_t b) {
+    if (r->len == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 1 << 12;
+        uint8_t *p = realloc(r->buf, cap);
+        if (p == NULL) {
+            r->failed = true;
+            return;
+        }
+        r->buf = p;
+        r->cap = cap;
+    }
+    r->buf[r->len++] = b;
+}
+
+static void put_varint(struct lc3_replay *r, uint64_t v) {
+    while (v >= 0x80) {
+        put_byte(r, (v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    put_byte(r, v);
+}
+
+static bool get_varint(struct lc3_replay *r, uint64_t *v) {
+    *v = 0;
+    for (int sh = 0; r->pos < r->len && sh < 64; sh += 7) {
+        uint8_t b = r->buf[r->pos++];
+        *v |= (uint64_t)(b & 0x7F) << sh;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// A log that is only kept in memory, for the debugger to rewind
+struct lc3_replay *replay_memory(void) {
+    struct lc3_replay *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+    uint16_t version = REPLAY_VERSION;
+    for (int i = 0; i < 4; i++) put_byte(r, REPLAY_MAGIC[i]);
+    put_byte(r, version & 0xFF);
+    put_byte(r, version >> 8);
+    r->live = true;
+    r->pos = r->len;
+    return r;
+}
+
+struct lc3_replay *replay_record(const char *path) {
+    struct lc3_replay *r = replay_memory();
+    if (r == NULL) {
+        return NULL;
+    }
+    if ((r->f = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "Cannot open replay log %s\n", path);
+        replay_close(r);
+        return NULL;
+    }
+    fwrite(r->buf, 1, r->len, r->f);
+    return r;
+}
+
+struct lc3_replay *replay_open(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open replay log %s\n", path);
+        return NULL;
+    }
+    struct lc3_replay *r = calloc(1, sizeof(*r));
+    size_t cap = 1 << 16;
+    uint8_t *buf = malloc(cap);
+    size_t len = 0, n;
+    while (r && buf && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            uint8_t *p = realloc(buf, cap *= 2);
+            if (p == NULL) break;
+            buf = p;
+        }
+    }
+    fclose(f);
+
+    uint16_t version;
+    if (r == NULL || buf == NULL || len < 6 || memcmp(buf, REPLAY_MAGIC, 4) != 0 ||
+        (memcpy(&version, buf + 4, sizeof(version)), version != REPLAY_VERSION)) {
+        fprintf(stderr, "%s is not a replay log\n", path);
+        free(buf);
+        free(r);
+        return NULL;
+    }
+    r->playing = true;
+    r->buf = buf;
+    r->len = r->cap = len;
+    r->pos = 6;
+    return r;
+}
+
+static void put_ev(struct lc3_replay *r, enum replay_ev kind, uint64_t icount, uint64_t v) {
+    size_t start = r->len;
+    put_byte(r, kind);
+    put_varint(r, icount - r->at);
+    put_varint(r, v);
+    if (r->f && !r->failed) fwrite(r->buf + start, 1, r->len - start, r->f);
+    r->pos = r->len;
+    r->n++;
+    r->at = icount;
+}
+
+static void flush_idle(struct lc3_replay *r) {
+    if (r->idle) {
+        put_ev(r, EV_IDLE, r->idle_at, r->idle);
+        r->idle = 0;
+    }
+}
+
+void replay_close(struct lc3_replay *r) {
+    if (r == NULL) {
+        return;
+    }
+    if (r->f) {
+        flush_idle(r);
+        fclose(r->f);
+    } else if (!r->live && !r->failed && (r->pos < r->len || r->idle_left)) {
+        fprintf(stderr, "Replay stopped with %zu bytes of the log unread\n", r->len - r->pos);
+    }
+    free(r->buf);
+    free(r);
+}
+
+bool replay_playing(const struct lc3_replay *r) {
+    return r->playing;
+}
+
+// True once playback stopped the run (divergence, end or corruption of the
+// log) or recording lost events
+bool replay_failed(const struct lc3_replay *r) {
+    return r->failed;
+}
+
+// Log what the program got: a byte, KBD_EOF or KBD_NONE for polls, -1 for
+// INU16 without a number. Empty polls are run-length encoded.
+void replay_put(struct lc3_replay *r, uint64_t icount, enum replay_ev kind, int value) {
+    if (kind == EV_POLL && value == KBD_NONE) {
+        if (r->idle++ == 0) r->idle_at = icount;
+        return;
+    }
+    flush_idle(r);
+    put_ev(r, kind, icount, (uint64_t)(value + 1));
+}
+
+// Next input of the given kind, as replay_put() got it. False once the log
+// is used up or the program asks for something the recording did not. A
+// recording log that was rewound goes back to recording at its end, and
+// returns false without complaint.
+bool replay_get(struct lc3_replay *r, enum replay_ev kind, int *value) {
+    if (r->failed) {
+        return false;
+    }
+    if (kind == EV_POLL && r->idle_left) {
+        r->idle_left--;
+        *value = KBD_NONE;
+        return true;
+    }
+
+    uint64_t d, v;
+    if (r->pos >= r->len && r->live) {
+        r->playing = false;
+        return false;
+    }
+    if (r->pos >= r->len) {
+        fprintf(stderr, "Replay log ends after %llu events (instruction %llu)\n",
+                (unsigned long long)r->n, (unsigned long long)r->at);
+        r->failed = true;
+        return false;
+    }
+    uint8_t k = r->buf[r->pos++];
+    if (k < EV_POLL || k > EV_U16 || !get_varint(r, &d) || !get_varint(r, &v)) {
+        fprintf(stderr, "Replay log is corrupt at event %llu\n", (unsigned long long)r->n);
+        r->failed = true;
+        return false;
+    }
+    r->n++;
+    r->at += d;
+
+    if (k == EV_IDLE && kind == EV_POLL && v > 0) {
+        r->idle_left = v - 1;
+        *value = KBD_NONE;
+        return true;
+    }
+    if (k != kind) {
+        fprintf(stderr, "Replay diverged at event %llu (instruction %llu): recorded %s, program asked for %s\n",
+                (unsigned long long)r->n, (unsigned long long)r->at, ev_names[k], ev_names[kind]);
+        r->failed = true;
+        return false;
+    }
+    *value = (int)v - 1;
+    return true;
+}
+
+// Where the run is now. Pending empty polls are written out first, so the
+// mark falls between two events or inside a played back run.
+void replay_mark(struct lc3_replay *r, struct replay_mark *m) {
+    if (!r->playing) flush_idle(r);
+    m->pos = r->pos;
+    m->n = r->n;
+    m->at = r->at;
+    m->idle_left = r->idle_left;
+}
+
+// Back to a mark taken earlier: the events after it are played back again
+void replay_seek(struct lc3_replay *r, const struct replay_mark *m) {
+    if (!r->playing) flush_idle(r);
+    r->pos = m->pos;
+    r->n = m->n;
+    r->at = m->at;
+    r->idle_left = m->idle_left;
+    r->failed = false;
+    r->playing = r->pos < r->len || r->idle_left || !r->live;
+}
+
+// Drop what a rewound recording would play back: the run took another
+// turn here, so it records again from this point
+void replay_cut(struct lc3_replay *r) {
+    if (!r->live || !r->playing) {
+        return;
+    }
+    r->len = r->pos;
+    r->idle_left = 0;
+    r->playing = false;
+    if (r->f) {
+        fflush(r->f);
+        if (ftruncate(fileno(r->f), r->len) == 0) fseek(r->f, r->len, SEEK_SET);
+    }
+}
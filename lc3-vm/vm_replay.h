@@ -0,0 +1,44 @@
+#ifndef VM_REPLAY_H
+#define VM_REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Input log of one run: every keyboard result the program saw, in order.
+// Given the same log, a run takes the same path, so replay needs neither a
+// terminal nor instruction counting and runs on any core. A recording log
+// can be rewound with replay_seek(); it then plays back up to where it
+// was and records again from there.
+#define REPLAY_MAGIC "LC3E"
+#define REPLAY_VERSION 1
+
+// On disk: magic, uint16 version, then per event a kind byte and two
+// LEB128 varints, the instruction count since the previous event and:
+enum replay_ev {
+    EV_POLL = 1,                       // KBSR poll that found a byte: byte + 1, 0 for EOF
+    EV_IDLE,                           // Run of KBSR polls that found nothing: length
+    EV_GETC,                           // GETC/IN: byte + 1, 0 for EOF
+    EV_U16                             // INU16: value + 1, 0 when no number followed
+};
+
+struct lc3_replay;
+
+// Position in the log, for going back to an earlier point of the run
+struct replay_mark {
+    size_t pos;
+    uint64_t n, at, idle_left;
+};
+
+struct lc3_replay *replay_record(const char *path);
+struct lc3_replay *replay_memory(void);
+struct lc3_replay *replay_open(const char *path);
+void replay_close(struct lc3_replay *r);
+bool replay_playing(const struct lc3_replay *r);
+bool replay_failed(const struct lc3_replay *r);
+void replay_put(struct lc3_replay *r, uint64_t icount, enum replay_ev kind, int value);
+bool replay_get(struct lc3_replay *r, enum replay_ev kind, int *value);
+void replay_mark(struct lc3_replay *r, struct replay_mark *m);
+void replay_seek(struct lc3_replay *r, const struct replay_mark *m);
+void replay_cut(struct lc3_replay *r);
+
+#endif
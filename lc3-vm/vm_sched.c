@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "vm_sched.h"
+#include "vm_load.h"
+#include "vm_snap.h"
+
+struct sched {
+    struct lc3_job *jobs;
+    int njobs;
+    enum vm_core core;
+    _Atomic int next;                  // Next job to hand out
+    _Atomic int failed;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Worker: pull jobs until none are left. The last image loaded is kept as a
+// snapshot, so running the same image again is a restore, not a reload.
+static void *sched_worker(void *arg) {
+    struct sched *s = arg;
+    struct lc3_vm *vm = vm_create();
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm->core = s->core;
+    struct lc3_snap *snap = NULL;
+    const char *snap_image = NULL;
+
+    int k;
+    while ((k = atomic_fetch_add(&s->next, 1)) < s->njobs) {
+        struct lc3_job *job = &s->jobs[k];
+        uint64_t t0 = now_ns();
+
+        job->loaded = snap && strcmp(snap_image, job->image) == 0 && vm_restore(vm, snap) == 0;
+        if (!job->loaded) {
+            vm_snap_free(snap);
+            snap = NULL;
+            vm_reset(vm);
+            job->loaded = ld_img(vm, job->image, 0x0) > 0;
+            if (!job->loaded) {
+                atomic_fetch_add(&s->failed, 1);
+                continue;
+            }
+            snap = vm_snapshot(vm);
+            snap_image = job->image;
+        }
+
+        // No reader or timer threads per job: input is a file or a pipe and
+        // output only needs to be complete once the image halts
+        kbd_init(&vm->io, job->in_fd, false);
+        out_init(&vm->io, job->out_fd, 0);
+        start(vm, 0x0);
+        out_close(&vm->io);
+
+        job->ns = now_ns() - t0;
+        memcpy(job->reg, vm->reg, sizeof(job->reg));
+    }
+
+    vm_snap_free(snap);
+    vm_destroy(vm);
+    return NULL;
+}
+
+int sched_run(struct lc3_job *jobs, int njobs, int threads, enum vm_core core) {
+    struct sched s = { .jobs = jobs, .njobs = njobs, .core = core };
+    atomic_init(&s.next, 0);
+    atomic_init(&s.failed, 0);
+
+    if (threads < 1) threads = 1;
+    if (threads > njobs) threads = njobs;
+
+    pthread_t *tid = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; tid && t < threads; t++) {
+        if (pthread_create(&tid[t], NULL, sched_worker, &s) != 0) break;
+        started++;
+    }
+    // Could not spawn anything, run the queue here
+    if (started == 0) {
+        sched_worker(&s);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    free(tid);
+
+    // Jobs a failed vm_create() never reached count as failures too
+    int left = atomic_load(&s.next) < njobs ? njobs - atomic_load(&s.next) : 0;
+    for (int k = njobs - left; k < njobs; k++) {
+        jobs[k].loaded = false;
+    }
+    return atomic_load(&s.failed) + left;
+}
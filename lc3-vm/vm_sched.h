@@ -0,0 +1,26 @@
+#ifndef VM_SCHED_H
+#define VM_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+// One image to run on the pool. Input and output are file descriptors owned
+// by the caller; in_fd < 0 means no input, out_fd < 0 throws output away.
+struct lc3_job {
+    const char *image;
+    int in_fd;
+    int out_fd;
+
+    // Filled in by the worker
+    bool loaded;
+    uint64_t ns;                       // Wall time of load + run
+    uint16_t reg[RCNT];                // Registers after the run
+};
+
+// Run every job on up to `threads` worker threads, each reusing one VM.
+// Returns the number of jobs that could not be loaded.
+int sched_run(struct lc3_job *jobs, int njobs, int threads, enum vm_core core);
+
+#endif
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vm_snap.h"
+#include "vm_jit.h"
+
+struct lc3_snap {
+    int fd;                            // memfd holding MEM_BYTES, -1 if unavailable
+    uint16_t *copy;                    // Plain copy when there is no memfd
+    uint16_t reg[RCNT];
+    struct lc3_sys sys;
+    uint64_t dirty[NPAGES / 64];
+    uint16_t pc_start;
+};
+
+// Take a snapshot of vm as it is now: after ld_img(), or wherever vm_run()
+// returned. The VM itself is not changed.
+struct lc3_snap *vm_snapshot(struct lc3_vm *vm) {
+    struct lc3_snap *s = malloc(sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->fd = -1;
+    s->copy = NULL;
+
+#if defined(__linux__)
+    s->fd = memfd_create("lc3-snap", MFD_CLOEXEC);
+    if (s->fd >= 0) {
+        size_t off = 0;
+        while (off < MEM_BYTES) {
+            ssize_t n = pwrite(s->fd, (char *)vm->mem + off, MEM_BYTES - off, off);
+            if (n <= 0) break;
+            off += n;
+        }
+        if (off < MEM_BYTES) {
+            close(s->fd);
+            s->fd = -1;
+        }
+    }
+#endif
+    if (s->fd < 0) {
+        s->copy = malloc(MEM_BYTES);
+        if (s->copy == NULL) {
+            free(s);
+            return NULL;
+        }
+        memcpy(s->copy, vm->mem, MEM_BYTES);
+    }
+
+    memcpy(s->reg, vm->reg, sizeof(s->reg));
+    s->sys = vm->sys;
+    memcpy(s->dirty, vm->dirty, sizeof(s->dirty));
+    s->pc_start = vm->pc_start;
+    return s;
+}
+
+void vm_snap_free(struct lc3_snap *s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s->copy);
+    free(s);
+}
+
+// Put vm back into the snapshotted state. Options, core and console streams
+// are kept. Returns -1 if memory could not be restored.
+int vm_restore(struct lc3_vm *vm, const struct lc3_snap *s) {
+    if (s->fd >= 0) {
+        // Replacing the mapping drops whatever the last run dirtied
+        if (mmap(vm->mem, MEM_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, s->fd, 0) == MAP_FAILED) {
+            return -1;
+        }
+    } else {
+        memcpy(vm->mem, s->copy, MEM_BYTES);
+    }
+
+    memcpy(vm->reg, s->reg, sizeof(vm->reg));
+    vm->sys = s->sys;
+    memcpy(vm->dirty, s->dirty, sizeof(vm->dirty));
+    vm->pc_start = s->pc_start;
+    vm->running = true;
+    if (vm->jit) {
+        jit_reset(vm->jit);            // Compiled code describes the old memory
+    }
+    return 0;
+}
+
+// New VM in the snapshotted state, with default options
+struct lc3_vm *vm_fork(const struct lc3_snap *s) {
+    struct lc3_vm *vm = vm_create();
+    if (vm && vm_restore(vm, s) < 0) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
@@ -0,0 +1,16 @@
+#ifndef VM_SNAP_H
+#define VM_SNAP_H
+
+#include "vm.h"
+
+// Frozen copy of a VM's memory and registers. Memory is kept in a memfd;
+// restoring maps it copy-on-write over the VM's memory, so only the pages
+// the program writes afterwards are ever copied.
+struct lc3_snap;
+
+struct lc3_snap *vm_snapshot(struct lc3_vm *vm);
+void vm_snap_free(struct lc3_snap *s);
+int vm_restore(struct lc3_vm *vm, const struct lc3_snap *s);
+struct lc3_vm *vm_fork(const struct lc3_snap *s);
+
+#endif
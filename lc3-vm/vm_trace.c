@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_trace.h"
+
+static void write_all(int fd, const void *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        p = (const char *)p + w;
+        n -= w;
+    }
+}
+
+// Writer thread: stream contiguous runs of the ring to the file
+static void *trace_writer(void *arg) {
+    struct lc3_trace *t = arg;
+
+    for (;;) {
+        size_t tl = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        size_t h = atomic_load_explicit(&t->head, memory_order_acquire);
+        if (tl == h) {
+            if (atomic_load(&t->stop)) break;
+            struct timespec ts = { 0, 1000000L };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        size_t off = tl & (TRACE_RING_SIZE - 1);
+        size_t n = h - tl;
+        if (n > TRACE_RING_SIZE - off) n = TRACE_RING_SIZE - off;
+        write_all(t->fd, &t->ring[off], n * sizeof(struct trace_rec));
+        atomic_store_explicit(&t->tail, tl + n, memory_order_release);
+    }
+    return NULL;
+}
+
+struct lc3_trace *trace_open(const char *path) {
+    struct lc3_trace *t = malloc(sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        free(t);
+        return NULL;
+    }
+
+    struct trace_hdr hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_rec) };
+    write_all(t->fd, &hdr, sizeof(hdr));
+
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->stop, false);
+    t->pc = t->instr = 0;
+    if (pthread_create(&t->thread, NULL, trace_writer, t) != 0) {
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Drain everything and close the file
+void trace_close(struct lc3_trace *t) {
+    if (t == NULL) {
+        return;
+    }
+    atomic_store(&t->stop, true);
+    pthread_join(t->thread, NULL);
+    close(t->fd);
+    free(t);
+}
+
+void trace_put(struct lc3_trace *t, uint8_t kind, uint16_t addr, uint16_t old, uint16_t val) {
+    size_t h = atomic_load_explicit(&t->head, memory_order_relaxed);
+    while (h - atomic_load_explicit(&t->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        struct timespec ts = { 0, 100000L };
+        nanosleep(&ts, NULL);          // Full, wait for the writer
+    }
+    t->ring[h & (TRACE_RING_SIZE - 1)] = (struct trace_rec){
+        .pc = t->pc, .instr = t->instr, .addr = addr, .old = old, .val = val, .kind = kind
+    };
+    atomic_store_explicit(&t->head, h + 1, memory_order_release);
+}
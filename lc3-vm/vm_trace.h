@@ -0,0 +1,56 @@
+#ifndef VM_TRACE_H
+#define VM_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Binary memory trace: fixed-size records go into a ring owned by the VM
+// thread and a writer thread streams them to a file. lc3-trace decodes it.
+#define TRACE_RING_SIZE (1 << 16)      // Records, power of two
+#define TRACE_FILE "lc3-vm.trace"      // Used when MEMORY_TRACE is compiled in
+
+#define TRACE_MAGIC "LC3T"
+#define TRACE_VERSION 1
+
+enum trace_kind { TRACE_READ = 0, TRACE_WRITE = 1 };
+
+// On disk: a trace_hdr, then host-endian trace_recs
+struct trace_hdr {
+    char magic[4];
+    uint16_t version;
+    uint16_t rec_size;
+};
+
+struct trace_rec {
+    uint16_t pc;                       // Address of the executing instruction
+    uint16_t instr;                    // Its instruction word
+    uint16_t addr;
+    uint16_t old;                      // Value before a write, same as val for reads
+    uint16_t val;
+    uint8_t kind;
+    uint8_t pad;
+};
+
+struct lc3_trace {
+    struct trace_rec ring[TRACE_RING_SIZE];
+    _Atomic size_t head, tail;         // VM thread produces, writer consumes
+    atomic_bool stop;
+    pthread_t thread;
+    int fd;
+
+    uint16_t pc, instr;                // Instruction being executed
+};
+
+struct lc3_trace *trace_open(const char *path);
+void trace_close(struct lc3_trace *t);
+void trace_put(struct lc3_trace *t, uint8_t kind, uint16_t addr, uint16_t old, uint16_t val);
+
+// Instruction about to run, stamped on the records it causes
+static inline void trace_at(struct lc3_trace *t, uint16_t pc, uint16_t instr) {
+    t->pc = pc;
+    t->instr = instr;
+}
+
+#endif